@@ -0,0 +1,67 @@
+// Helpers for arrays of bits packed into 64-bit words. Bit i of such an array
+// is bit (i % 64) of word i / 64.
+
+#ifndef NG_BITS_INCLUDED
+#define NG_BITS_INCLUDED
+
+#include <cstdint>
+
+inline unsigned popcount64(uint64_t x) {
+#ifdef __GNUC__
+  return __builtin_popcountll(x);
+#else
+  x = x - ((x >> 1) & 0x5555555555555555ull);
+  x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+  return (x * 0x0101010101010101ull) >> 56;
+#endif
+}
+
+// The index of the lowest set bit; x must not be 0
+inline unsigned ctz64(uint64_t x) {
+#ifdef __GNUC__
+  return __builtin_ctzll(x);
+#else
+  unsigned n = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+// A word with the lowest n bits set, 0 <= n <= 64
+inline uint64_t low_bits(unsigned n) {
+  return n >= 64 ? ~0ull : (1ull << n) - 1;
+}
+
+// Read n bits (1 <= n <= 64) starting at bit pos
+inline uint64_t get_bits(const uint64_t *words, unsigned long pos, unsigned n) {
+  unsigned long w = pos / 64;
+  unsigned b = pos % 64;
+  uint64_t v = words[w] >> b;
+  if (b != 0 && b + n > 64)
+    v |= words[w + 1] << (64 - b);
+  return v & low_bits(n);
+}
+
+// The index of the first bit at or after pos (and before n) that equals value,
+// or n if there is none
+inline unsigned long find_bit(const uint64_t *words, unsigned long pos,
+                              unsigned long n, bool value) {
+  while (pos < n) {
+    uint64_t w = words[pos / 64];
+    if (!value)
+      w = ~w;
+    w &= ~low_bits(pos % 64);
+    if (w != 0) {
+      unsigned long i = pos / 64 * 64 + ctz64(w);
+      return i < n ? i : n;
+    }
+    pos = (pos / 64 + 1) * 64;
+  }
+  return n;
+}
+
+#endif
@@ -0,0 +1,1269 @@
+// The gate engine: the detector, non-silence and smoothing windows and the
+// latency buffer that the plugins in ng.cpp are built from, and PcmNoiseGate,
+// which runs them on integer PCM samples outside of a plugin host.
+
+#ifndef NG_GATE_INCLUDED
+#define NG_GATE_INCLUDED
+
+#include <ladspa.h>
+#include <cmath>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#ifdef __unix__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "bits.h"
+#include "simd.h"
+
+// What the engine needs to know about a sample type: the type of its
+// absolute value, wide enough for that of the most negative sample, and the
+// absolute value of full scale (0 dBFS).
+template <typename Sample> struct SampleTraits;
+
+template <> struct SampleTraits<float> {
+  typedef float Magnitude;
+  static float full_scale() { return 1; }
+  static Magnitude magnitude(float x) { return std::abs(x); }
+  static Magnitude to_magnitude(float x) { return x; }
+};
+
+template <> struct SampleTraits<int16_t> {
+  typedef int32_t Magnitude;
+  static float full_scale() { return 32768; }
+  static Magnitude magnitude(int16_t x) { return x < 0 ? -(Magnitude) x : x; }
+  static Magnitude to_magnitude(float x) { return lrintf(x); }
+};
+
+template <> struct SampleTraits<int32_t> {
+  typedef int64_t Magnitude;
+  static float full_scale() { return 2147483648.f; }
+  static Magnitude magnitude(int32_t x) { return x < 0 ? -(Magnitude) x : x; }
+  static Magnitude to_magnitude(float x) { return llrintf(x); }
+};
+
+// Portable counterparts of the float helpers in simd.h for the integer
+// sample types; see there.
+
+template <typename T>
+void abs_block(const T *in, typename SampleTraits<T>::Magnitude *out,
+               unsigned long n) {
+  for (unsigned long i = 0; i < n; i++)
+    out[i] = SampleTraits<T>::magnitude(in[i]);
+}
+
+template <typename M>
+void max_block(const M *a, const M *b, M *out, unsigned long n) {
+  for (unsigned long i = 0; i < n; i++)
+    out[i] = a[i] > b[i] ? a[i] : b[i];
+}
+
+template <typename T>
+typename SampleTraits<T>::Magnitude max_abs(const T *a, unsigned long n) {
+  typename SampleTraits<T>::Magnitude m = 0;
+  for (unsigned long i = 0; i < n; i++)
+    m = std::max(m, SampleTraits<T>::magnitude(a[i]));
+  return m;
+}
+
+template <typename M>
+void pack_ge(const M *a, M t, uint64_t *words, unsigned long n) {
+  for (unsigned long w = 0; w * 64 < n; w++) {
+    unsigned long m = std::min(n - w * 64, 64ul);
+    uint64_t bits = 0;
+    for (unsigned long i = 0; i < m; i++)
+      bits |= (uint64_t) (a[w * 64 + i] >= t) << i;
+    words[w] = bits;
+  }
+}
+
+template <typename T>
+void interleave(const T *const *in, unsigned long offset, unsigned channels,
+                T *out, unsigned long n) {
+  for (unsigned long i = 0; i < n; i++) {
+    for (unsigned c = 0; c < channels; c++)
+      out[i * channels + c] = in[c][offset + i];
+  }
+}
+
+// pack_s16() and friends for the integer sample types, by way of float
+template <typename T>
+void pack_s16(const T *in, int16_t *out, unsigned long n) {
+  for (unsigned long i = 0; i < n; i++) {
+    float x = in[i] / SampleTraits<T>::full_scale();
+    pack_s16(&x, out + i, 1);
+  }
+}
+
+template <typename T>
+void unpack_s16(const int16_t *in, T *out, unsigned long n) {
+  for (unsigned long i = 0; i < n; i++) {
+    float x;
+    unpack_s16(in + i, &x, 1);
+    out[i] = (T) lrint((double) x * SampleTraits<T>::full_scale());
+  }
+}
+
+template <typename T>
+void pack_s24(const T *in, uint8_t *out, unsigned long n) {
+  for (unsigned long i = 0; i < n; i++) {
+    float x = in[i] / SampleTraits<T>::full_scale();
+    pack_s24(&x, out + 3 * i, 1);
+  }
+}
+
+template <typename T>
+void unpack_s24(const uint8_t *in, T *out, unsigned long n) {
+  for (unsigned long i = 0; i < n; i++) {
+    float x;
+    unpack_s24(in + 3 * i, &x, 1);
+    out[i] = (T) lrint((double) x * SampleTraits<T>::full_scale());
+  }
+}
+
+// The sample x of the way from a to b
+inline float crossfade(float a, float b, float x) {
+  return a + x * (b - a);
+}
+
+template <typename T>
+T crossfade(T a, T b, float x) {
+  return a + (T) lrint(x * ((double) b - a));
+}
+
+// out[i] = in[i] * gain[i]; integer samples are scaled in fixed point, by the
+// gain rounded to 15 fractional bits
+inline void apply_gain(const float *in, const float *gain, float *out,
+                       unsigned long n) {
+  mul_block(in, gain, out, n);
+}
+
+template <typename T>
+void apply_gain(const T *in, const float *gain, T *out, unsigned long n) {
+  typedef typename SampleTraits<T>::Magnitude M;
+  for (unsigned long i = 0; i < n; i++) {
+    M q = lrintf(gain[i] * 32768);
+    out[i] = (T) (((M) in[i] * q + (1 << 14)) >> 15);
+  }
+}
+
+// A sliding window that maintains its maximum absolute value
+//
+// This is the van Herk/Gil-Werman algorithm. The stream is cut into segments of
+// window_size samples. Within the current segment we keep the running
+// (prefix) maximum; when a segment is complete, we compute its suffix maxima.
+// A window ending at offset j of the current segment is then covered by the
+// suffix of the previous segment starting at j + 1 and the prefix of the
+// current one ending at j, so each sample costs three max operations and no
+// branches.
+//
+// The samples are of type Sample, and their absolute values of the wider
+// SampleTraits<Sample>::Magnitude.
+template <typename Sample>
+class MaxWindow {
+  public:
+    typedef typename SampleTraits<Sample>::Magnitude Magnitude;
+  private:
+    // The size the storage is allocated for
+    unsigned long max_window_size;
+    // Window size.
+    unsigned long window_size;
+    // Absolute values of the samples in the current segment.
+    std::vector<Magnitude> segment;
+    // Suffix maxima of the previous segment; suffix[window_size] == 0.
+    std::vector<Magnitude> suffix;
+    // Number of samples in the current segment so far.
+    unsigned long pos = 0;
+    // Maximum of the current segment so far.
+    Magnitude prefix = 0;
+    // Total cumulative number of samples pushed into this window.
+    unsigned long n_samples = 0;
+    Magnitude last_level = 0;
+  public:
+    MaxWindow(unsigned long max_window_size)
+      : max_window_size(std::max(max_window_size, 1ul)),
+        window_size(this->max_window_size),
+        segment(this->window_size), suffix(this->window_size + 1) {};
+    // Change the window size (at most the initial one), forgetting all samples
+    void set_window_size(unsigned long new_window_size) {
+      window_size = std::min(std::max(new_window_size, 1ul), max_window_size);
+      reset();
+    }
+    // Forget all samples, as if newly constructed
+    void reset() {
+      std::fill(segment.begin(), segment.end(), 0);
+      std::fill(suffix.begin(), suffix.end(), 0);
+      pos = 0;
+      prefix = 0;
+      n_samples = 0;
+      last_level = 0;
+    }
+    Magnitude level() const {
+      return last_level;
+    }
+    unsigned long size() const {
+      return window_size;
+    }
+    // Push a block of samples, storing the level after each one in levels
+    void process(const Sample *samples, Magnitude *levels,
+                 unsigned long n) {
+      // The original deque-based implementation of this class dropped the
+      // whole window on every push until it had seen window_size - 1 samples,
+      // so its level was just the current sample's. Reproduce that by
+      // keeping those samples out of the window.
+      unsigned long i = 0;
+      for (; i < n && n_samples < window_size - 1; i++, n_samples++) {
+        levels[i] = SampleTraits<Sample>::magnitude(samples[i]);
+        segment[pos] = 0;
+        if (++pos == window_size)
+          finish_segment();
+      }
+      while (i < n) {
+        unsigned long m = std::min(n - i, window_size - pos);
+        Magnitude *seg = segment.data() + pos;
+        abs_block(samples + i, seg, m);
+        for (unsigned long k = 0; k < m; k++) {
+          prefix = std::max(prefix, seg[k]);
+          levels[i + k] = prefix;
+        }
+        max_block(levels + i, suffix.data() + pos + 1, levels + i, m);
+        i += m;
+        n_samples += m;
+        pos += m;
+        if (pos == window_size)
+          finish_segment();
+      }
+      if (n > 0)
+        last_level = levels[n - 1];
+    }
+    // Has the window seen enough samples for level() to be the maximum over
+    // a whole window_size samples?
+    bool filled() const {
+      return n_samples >= window_size - 1;
+    }
+    // Push a block of samples like process(), but without computing their
+    // levels. Only the last two segments are stored; samples before them
+    // are skipped.
+    void advance(const Sample *samples, unsigned long n) {
+      if (n == 0)
+        return;
+      unsigned long i = 0;
+      for (; i < n && n_samples < window_size - 1; i++, n_samples++) {
+        segment[pos] = 0;
+        if (++pos == window_size)
+          finish_segment();
+      }
+      if (i == n) {
+        last_level = SampleTraits<Sample>::magnitude(samples[n - 1]);
+        return;
+      }
+      n_samples += n - i;
+      // The segment boundary before the last one within the block
+      unsigned long end_pos = (pos + n - i) % window_size;
+      unsigned long first_boundary = i + (window_size - pos) % window_size;
+      if (n >= end_pos + window_size &&
+          n - end_pos - window_size >= first_boundary) {
+        i = n - end_pos - window_size;
+        pos = 0;
+        prefix = 0;
+      }
+      while (i < n) {
+        unsigned long m = std::min(n - i, window_size - pos);
+        abs_block(samples + i, segment.data() + pos, m);
+        prefix = std::max(prefix, max_abs(samples + i, m));
+        i += m;
+        pos += m;
+        if (pos == window_size)
+          finish_segment();
+      }
+      last_level = std::max(prefix, suffix[pos]);
+    }
+  private:
+    void finish_segment() {
+      Magnitude m = 0;
+      for (unsigned long j = window_size; j-- > 0; ) {
+        m = std::max(m, segment[j]);
+        suffix[j] = m;
+      }
+      pos = 0;
+      prefix = 0;
+    }
+};
+
+// A sliding window that knows at each moment how much non-silence it contains.
+//
+// The window has the latency ns_window_size.
+//
+// There are two ways to store the window, BitNonSilenceWindow and
+// TransitionNonSilenceWindow below; this class holds what they share.
+//
+// The storage is allocated for max_window_size flags up front. Both
+// implementations remember that many past flags, so the window size can be
+// changed at any time without losing the count.
+class NonSilenceWindow {
+  protected:
+    unsigned long max_window_size;
+    unsigned long window_size;
+    LADSPA_Data sample_rate;
+    unsigned long nonsilent_samples = 0;
+    // The cached result of min_count()
+    bool cache_valid = false;
+    LADSPA_Data cached_min_nonsilent;
+    unsigned long cached_min_count;
+    // Called after window_size has changed; must recompute nonsilent_samples
+    virtual void window_size_changed() = 0;
+  public:
+    // The smallest number of non-silent samples c such that
+    // c / sample_rate >= min_nonsilent, computed exactly the way nonsilent()
+    // computes it, so that comparing counts gives the same answer as
+    // comparing nonsilent() to min_nonsilent.
+    unsigned long min_count(LADSPA_Data min_nonsilent) {
+      if (cache_valid && min_nonsilent == cached_min_nonsilent)
+        return cached_min_count;
+      unsigned long c;
+      if (!(min_nonsilent > 0)) {
+        // NaN never compares true
+        c = min_nonsilent <= 0 ? 0 : window_size + 1;
+      } else if (!(window_size / sample_rate >= min_nonsilent)) {
+        c = window_size + 1;
+      } else {
+        c = std::min((unsigned long) ceil(min_nonsilent * sample_rate), window_size);
+        while (c > 0 && (c - 1) / sample_rate >= min_nonsilent)
+          c--;
+        while (!(c / sample_rate >= min_nonsilent))
+          c++;
+      }
+      cache_valid = true;
+      cached_min_nonsilent = min_nonsilent;
+      cached_min_count = c;
+      return c;
+    }
+    NonSilenceWindow(unsigned long max_window_size,
+                     LADSPA_Data sample_rate)
+      : max_window_size(max_window_size), window_size(max_window_size),
+        sample_rate(sample_rate)
+      {};
+    virtual ~NonSilenceWindow() {}
+    // Forget all flags (keeping the window size)
+    virtual void reset() {
+      nonsilent_samples = 0;
+    }
+    void set_window_size(unsigned long ns_window_size) {
+      ns_window_size = std::min(ns_window_size, max_window_size);
+      if (ns_window_size != window_size) {
+        window_size = ns_window_size;
+        cache_valid = false;
+        window_size_changed();
+      }
+    }
+    // Change the rate at which flags are pushed
+    void set_sample_rate(LADSPA_Data new_sample_rate) {
+      sample_rate = new_sample_rate;
+      cache_valid = false;
+    }
+    // Get the total amount of non-silence inside the window in seconds
+    LADSPA_Data nonsilent() const {
+      return nonsilent_samples / sample_rate;
+    }
+    // Push a block of non-silence flags (packed into words); open[i] tells
+    // whether the window contains at least min_nonsilent seconds of
+    // non-silence after the i-th push
+    virtual void process(const uint64_t *mask, LADSPA_Data min_nonsilent,
+                         bool *open, unsigned long n) = 0;
+    // Push a block of non-silence flags like process(), but store the number
+    // of non-silent samples in the window after the i-th push in count[i]
+    virtual void counts(const uint64_t *mask, unsigned long *count,
+                        unsigned long n) = 0;
+};
+
+// A NonSilenceWindow that stores the non-silence flags as a ring of bits packed
+// into 64-bit words.
+//
+// Whole words of flags are inserted and evicted at once and counted with
+// popcount.
+class BitNonSilenceWindow : public NonSilenceWindow {
+  private:
+    // The ring size in bits, a multiple of 64
+    unsigned long capacity;
+    std::vector<uint64_t> buf; // 1 == non-silent
+    // The position in buf of the next flag to be written.
+    unsigned long pos = 0;
+  protected:
+    void window_size_changed() override {
+      nonsilent_samples = 0;
+      unsigned long p = (pos + capacity - window_size) % capacity;
+      for (unsigned long left = window_size; left > 0; ) {
+        unsigned long m = std::min(std::min(64ul, left), capacity - p);
+        nonsilent_samples += popcount64(get_bits(buf.data(), p, m));
+        p = (p + m) % capacity;
+        left -= m;
+      }
+    }
+  public:
+    BitNonSilenceWindow(unsigned long max_window_size,
+                        LADSPA_Data sample_rate)
+      : NonSilenceWindow(max_window_size, sample_rate),
+        capacity((max_window_size + 63) / 64 * 64), buf(capacity / 64)
+      {};
+    void reset() override {
+      NonSilenceWindow::reset();
+      std::fill(buf.begin(), buf.end(), 0);
+      pos = 0;
+    }
+    void process(const uint64_t *mask, LADSPA_Data min_nonsilent, bool *open,
+                 unsigned long n) override {
+      unsigned long threshold = min_count(min_nonsilent);
+      push(mask, n, [&](unsigned long i, unsigned m,
+                        uint64_t old_bits, uint64_t new_bits) {
+        unsigned n_old = popcount64(old_bits), n_new = popcount64(new_bits);
+        // Within these m pushes the count never drops below
+        // nonsilent_samples - n_old and never exceeds
+        // nonsilent_samples + n_new.
+        if (nonsilent_samples - n_old >= threshold) {
+          memset(open + i, true, m);
+        } else if (nonsilent_samples + n_new < threshold) {
+          memset(open + i, false, m);
+        } else {
+          unsigned long count = nonsilent_samples;
+          for (unsigned k = 0; k < m; k++) {
+            count += ((new_bits >> k) & 1);
+            count -= ((old_bits >> k) & 1);
+            open[i + k] = count >= threshold;
+          }
+        }
+      });
+    }
+    void counts(const uint64_t *mask, unsigned long *count,
+                unsigned long n) override {
+      push(mask, n, [&](unsigned long i, unsigned m,
+                        uint64_t old_bits, uint64_t new_bits) {
+        unsigned long c = nonsilent_samples;
+        for (unsigned k = 0; k < m; k++) {
+          c += ((new_bits >> k) & 1);
+          c -= ((old_bits >> k) & 1);
+          count[i + k] = c;
+        }
+      });
+    }
+  private:
+    // Push n flags, calling f(i, m, old_bits, new_bits) for each chunk of m
+    // flags starting with the i-th, with the flags it evicts and inserts,
+    // before nonsilent_samples is updated for it
+    template <class F>
+    void push(const uint64_t *mask, unsigned long n, F f) {
+      for (unsigned long i = 0; i < n; ) {
+        // Take as many flags as fit into the current word of the ring, and
+        // whose evicted counterparts do not wrap around
+        unsigned long out = (pos + capacity - window_size) % capacity;
+        unsigned b = pos % 64;
+        unsigned m = std::min(std::min(64ul - b, n - i),
+                         std::min(capacity - out, window_size));
+        uint64_t &word = buf[pos / 64];
+        uint64_t old_bits = get_bits(buf.data(), out, m);
+        uint64_t new_bits = get_bits(mask, i, m);
+        f(i, m, old_bits, new_bits);
+        nonsilent_samples = nonsilent_samples - popcount64(old_bits)
+                          + popcount64(new_bits);
+        word = (word & ~(low_bits(m) << b)) | (new_bits << b);
+        i += m;
+        pos += m;
+        if (pos == capacity)
+          pos = 0;
+      }
+    }
+};
+
+// A NonSilenceWindow that only stores the sample indices where the
+// non-silence flag flips.
+//
+// Between two flips of either the newest or the evicted flag, the count of
+// non-silent samples changes by the same amount (-1, 0 or +1) on every push,
+// so the open/closed decisions for the whole stretch follow by arithmetic.
+// Memory traffic and work are thus proportional to the number of flips rather
+// than the number of samples, which pays off on material with long runs of
+// silence or non-silence.
+//
+// The flips are kept in a fixed-capacity ring. Its size relies on non-silent
+// runs being at least min_run samples long (as they are when the flags come
+// from a MaxWindow of that size), except within the first min_run samples.
+class TransitionNonSilenceWindow : public NonSilenceWindow {
+  private:
+    // Absolute indices of the samples where the flag flips; a power-of-two
+    // ring.
+    std::vector<uint64_t> transitions;
+    uint64_t ring_mask;
+    // transitions[first] is the oldest flip within max_window_size of the
+    // newest flag; transitions[out] is the oldest flip that has not left the
+    // window yet; transitions[last - 1] is the newest one.
+    uint64_t first = 0, out = 0, last = 0;
+    // The flag before transitions[first]
+    bool base_flag = false;
+    // The newest flag and the most recently evicted one
+    bool in_flag = false, out_flag = false;
+    // Total cumulative number of flags pushed into this window.
+    uint64_t n_samples = 0;
+    uint64_t transition(uint64_t i) const {
+      return transitions[i & ring_mask];
+    }
+    // Fill open[0..len) with the decisions for len pushes during which the
+    // count changes by slope on every push, starting from count
+    static void fill_open(bool *open, unsigned long len, unsigned long count,
+                          int slope, unsigned long threshold) {
+      if (slope == 0) {
+        memset(open, count >= threshold, len);
+      } else if (slope > 0) {
+        // open once count + k + 1 >= threshold
+        unsigned long n_closed = count + 1 >= threshold ? 0 : threshold - count - 1;
+        n_closed = std::min(n_closed, len);
+        memset(open, false, n_closed);
+        memset(open + n_closed, true, len - n_closed);
+      } else {
+        // open while count - k - 1 >= threshold
+        unsigned long n_open = count >= threshold ? std::min(count - threshold, len) : 0;
+        memset(open, true, n_open);
+        memset(open + n_open, false, len - n_open);
+      }
+    }
+  protected:
+    void window_size_changed() override {
+      // The most recently evicted flag is the one at n_samples - 1 - window_size
+      out = first;
+      out_flag = base_flag;
+      while (out < last && transition(out) + window_size < n_samples) {
+        out_flag = !out_flag;
+        out++;
+      }
+      // Add up the non-silent stretches since then
+      uint64_t t = n_samples > window_size ? n_samples - window_size : 0;
+      bool flag = out_flag;
+      nonsilent_samples = 0;
+      for (uint64_t k = out; k < last; k++) {
+        if (flag)
+          nonsilent_samples += transition(k) - t;
+        flag = !flag;
+        t = transition(k);
+      }
+      if (flag)
+        nonsilent_samples += n_samples - t;
+    }
+  public:
+    TransitionNonSilenceWindow(unsigned long max_window_size,
+                               LADSPA_Data sample_rate,
+                               unsigned long min_run,
+                               unsigned long max_block)
+      : NonSilenceWindow(max_window_size, sample_rate)
+      {
+        // Within the window plus one block, every non-silent run but the
+        // first few contributes two flips and takes at least min_run + 1
+        // samples together with the silence that follows it.
+        unsigned long max_transitions =
+          2 * ((max_window_size + max_block) / (min_run + 1) + 2) + min_run;
+        unsigned long capacity = 1;
+        while (capacity < max_transitions)
+          capacity *= 2;
+        transitions.resize(capacity);
+        ring_mask = capacity - 1;
+      };
+    void reset() override {
+      NonSilenceWindow::reset();
+      first = out = last = 0;
+      base_flag = in_flag = out_flag = false;
+      n_samples = 0;
+    }
+    void process(const uint64_t *mask, LADSPA_Data min_nonsilent, bool *open,
+                 unsigned long n) override {
+      unsigned long threshold = min_count(min_nonsilent);
+      push(mask, n, [&](unsigned long i, unsigned long len,
+                        unsigned long count, int slope) {
+        fill_open(open + i, len, count, slope, threshold);
+      });
+    }
+    void counts(const uint64_t *mask, unsigned long *count,
+                unsigned long n) override {
+      push(mask, n, [&](unsigned long i, unsigned long len,
+                        unsigned long c, int slope) {
+        for (unsigned long k = 0; k < len; k++)
+          count[i + k] = c + slope * (long) (k + 1);
+      });
+    }
+  private:
+    // Push n flags, calling f(i, len, count, slope) for each stretch of len
+    // pushes starting with the i-th, during which the count changes by slope
+    // on every push, starting from count
+    template <class F>
+    void push(const uint64_t *mask, unsigned long n, F f) {
+      uint64_t start = n_samples, end = n_samples + n;
+      // Record the flips within this block
+      uint64_t pending = last;
+      uint64_t prev = in_flag;
+      for (unsigned long w = 0; w * 64 < n; w++) {
+        uint64_t bits = mask[w];
+        uint64_t flips = (bits ^ ((bits << 1) | prev)) & low_bits(n - w * 64);
+        prev = bits >> 63;
+        while (flips) {
+          transitions[last++ & ring_mask] = start + w * 64 + ctz64(flips);
+          flips &= flips - 1;
+        }
+      }
+      // Walk the block from one flip of the newest or evicted flag to the next
+      unsigned long count = nonsilent_samples;
+      for (uint64_t t = start; t < end; ) {
+        if (pending < last && transition(pending) == t) {
+          in_flag = !in_flag;
+          pending++;
+        }
+        if (out < last && transition(out) + window_size == t) {
+          out_flag = !out_flag;
+          out++;
+        }
+        uint64_t next = end;
+        if (pending < last)
+          next = std::min(next, transition(pending));
+        if (out < last)
+          next = std::min(next, transition(out) + window_size);
+        int slope = (int) in_flag - (int) out_flag;
+        f(t - start, next - t, count, slope);
+        count += slope * (long) (next - t);
+        t = next;
+      }
+      nonsilent_samples = count;
+      n_samples = end;
+      // Forget the flips that no window size can reach any more
+      while (first < out && transition(first) + max_window_size < end) {
+        base_flag = !base_flag;
+        first++;
+      }
+    }
+};
+
+// A window that smoothes the transition between the open and closed states of
+// the gate.
+//
+// The state of the gate is represented by a bool: true = open, false = closed.
+//
+// When the gate moves from open to closed (true -> false), the gate closes
+// smoothly after that.
+//
+// When the gate moves from closed to open (false -> true), this event is
+// anticipated ahead of time and the transition is again smoothed.
+//
+// The gain during a transition is read from a table indexed by the position
+// within the ramp: position 0 is fully closed, position window_size fully
+// open, and each sample moves the position by one. There is a table for each
+// Curve, filled once for a ramp of max_window_size samples; a shorter ramp
+// reads every (max_window_size / window_size)-th entry, rounded to the
+// nearest, so that changing the window size costs nothing.
+//
+// Once fully open or fully closed, the scaling factor stays at 1 or 0, so
+// process() skips over such stretches without any arithmetic; while rising or
+// falling it reads the table.
+class SmoothingWindow {
+  public:
+    enum Curve { EXPONENTIAL, LINEAR, RAISED_COSINE, EQUAL_POWER };
+    // A stretch of samples over which the scaling factor is 1, 0, or follows
+    // a ramp
+    enum GainKind { UNITY_GAIN, ZERO_GAIN, VARYING_GAIN };
+    struct GainRun {
+      GainKind kind;
+      unsigned long length;
+    };
+  private:
+    const LADSPA_Data floor = 1e-4; // -80 dB, where the exponential curve starts
+    unsigned long max_window_size;
+    unsigned long window_size;
+    Curve curve;
+    // tables[curve][p] is the scaling factor at position
+    // p * window_size / max_window_size; tables[curve][0] == 0 and
+    // tables[curve][max_window_size] == 1.
+    std::vector<LADSPA_Data> tables[4];
+    // The current position within the ramp.
+    unsigned long position;
+    // Are we currently rising (true) or falling (false)?
+    bool rising = true;
+    // The number of samples since we've last seen the gate open.
+    // If it's more than the window size, we may begin to decrease the scaling
+    // factor.
+    long unsigned samples_since_open = 0;
+    void fill_table(Curve c) {
+      std::vector<LADSPA_Data> &table = tables[c];
+      table.resize(max_window_size + 1);
+      for (unsigned long p = 0; p <= max_window_size; p++) {
+        double x = (double) p / max_window_size;
+        double y = 0;
+        switch (c) {
+        case EXPONENTIAL:
+          y = p == 0 ? 0 : pow(floor, 1 - x);
+          break;
+        case LINEAR:
+          y = x;
+          break;
+        case RAISED_COSINE:
+          y = 0.5 - 0.5 * cos(M_PI * x);
+          break;
+        case EQUAL_POWER:
+          y = sin(M_PI / 2 * x);
+          break;
+        }
+        table[p] = y;
+      }
+      table[max_window_size] = 1;
+    }
+    // The index into the tables for a position
+    unsigned long table_index(unsigned long p) const {
+      return (p * max_window_size + window_size / 2) / window_size;
+    }
+    // Store the scaling factors for the n positions from p on, going up if
+    // up is set and down otherwise, in gain
+    void ramp(unsigned long p, bool up, LADSPA_Data *gain,
+              unsigned long n) const {
+      const LADSPA_Data *table = tables[curve].data();
+      if (window_size == max_window_size) {
+        for (unsigned long k = 0; k < n; k++)
+          gain[k] = table[up ? p + k : p - k];
+        return;
+      }
+      // Step the index by max_window_size / window_size, carrying the
+      // remainder, rather than dividing for every sample
+      unsigned long num = p * max_window_size + window_size / 2;
+      unsigned long index = num / window_size, rem = num % window_size;
+      unsigned long step = max_window_size / window_size;
+      unsigned long step_rem = max_window_size % window_size;
+      for (unsigned long k = 0; k < n; k++) {
+        gain[k] = table[index];
+        if (up) {
+          index += step;
+          rem += step_rem;
+          if (rem >= window_size) {
+            rem -= window_size;
+            index++;
+          }
+        } else {
+          index -= step;
+          if (rem < step_rem) {
+            rem += window_size;
+            index--;
+          }
+          rem -= step_rem;
+        }
+      }
+    }
+  public:
+    SmoothingWindow(unsigned long max_window_size, Curve curve = EXPONENTIAL)
+      : max_window_size(std::max(max_window_size, 1ul)),
+        window_size(this->max_window_size), curve(curve),
+        position(this->window_size)
+      {
+        fill_table(EXPONENTIAL);
+        fill_table(LINEAR);
+        fill_table(RAISED_COSINE);
+        fill_table(EQUAL_POWER);
+      }
+    // Change the ramp duration (at most max_window_size), keeping the
+    // relative position within the ramp
+    void set_window_size(unsigned long new_window_size) {
+      new_window_size = std::min(std::max(new_window_size, 1ul), max_window_size);
+      if (new_window_size == window_size)
+        return;
+      position = (position * new_window_size + window_size / 2) / window_size;
+      samples_since_open = std::min(samples_since_open, new_window_size);
+      window_size = new_window_size;
+    }
+    // Return to the fully open state with no history (keeping the window
+    // size and the curve)
+    void reset() {
+      position = window_size;
+      rising = true;
+      samples_since_open = 0;
+    }
+    void set_curve(Curve new_curve) {
+      curve = new_curve;
+    }
+    // Get the current scaling factor (with the latency equal to the
+    // attack/decay duration)
+    LADSPA_Data scaling_factor() const {
+      return tables[curve][table_index(position)];
+    }
+    // Push a block of gate states (is the gate open?) and split the block
+    // into runs of constant or ramping scaling factor, storing them in runs
+    // and returning their number (at most n). Within VARYING_GAIN runs, gain
+    // holds the scaling factor for each sample; elsewhere it is not written.
+    unsigned long process(const bool *open, LADSPA_Data *gain, GainRun *runs,
+                          unsigned long n) {
+      unsigned long n_runs = 0;
+      for (unsigned long i = 0; i < n; ) {
+        if (rising) {
+          unsigned long m = rising_run(open + i, n - i);
+          unsigned long n_ramp = std::min(m, window_size - position);
+          ramp(position + 1, true, gain + i, n_ramp);
+          position += n_ramp;
+          add_run(runs, n_runs, VARYING_GAIN, n_ramp);
+          add_run(runs, n_runs, UNITY_GAIN, m - n_ramp);
+          i += m;
+          if (i < n)
+            rising = false;
+        } else {
+          unsigned long m = falling_run(open + i, n - i);
+          unsigned long n_ramp = std::min(m, position);
+          ramp(position - 1, false, gain + i, n_ramp);
+          position -= n_ramp;
+          add_run(runs, n_runs, VARYING_GAIN, n_ramp);
+          add_run(runs, n_runs, ZERO_GAIN, m - n_ramp);
+          i += m;
+          if (i < n)
+            rising = true;
+        }
+      }
+      return n_runs;
+    }
+  private:
+    // While rising, consume the gate states up to (not including) the one
+    // that starts the decay, and return their number
+    unsigned long rising_run(const bool *open, unsigned long n) {
+      for (unsigned long j = 0; j < n; ) {
+        const void *closed = memchr(open + j, false, n - j);
+        unsigned long k = closed ? (const bool *) closed - open : n;
+        if (k > j)
+          samples_since_open = 0;
+        if (k == n)
+          break;
+        const void *opened = memchr(open + k, true, n - k);
+        unsigned long e = opened ? (const bool *) opened - open : n;
+        // The number of closed samples we can still see before we start falling
+        unsigned long allowed = window_size - samples_since_open;
+        if (e - k > allowed) {
+          samples_since_open = window_size;
+          return k + allowed;
+        }
+        samples_since_open += e - k;
+        j = e;
+      }
+      return n;
+    }
+    // While falling, consume the gate states up to (not including) the next
+    // open one, and return their number
+    unsigned long falling_run(const bool *open, unsigned long n) {
+      const void *opened = memchr(open, true, n);
+      unsigned long k = opened ? (const bool *) opened - open : n;
+      samples_since_open += k;
+      return k;
+    }
+    static void add_run(GainRun *runs, unsigned long &n_runs, GainKind kind,
+                        unsigned long length) {
+      if (length == 0)
+        return;
+      if (n_runs > 0 && runs[n_runs - 1].kind == kind) {
+        runs[n_runs - 1].length += length;
+      } else {
+        runs[n_runs].kind = kind;
+        runs[n_runs].length = length;
+        n_runs++;
+      }
+    }
+};
+
+// How a DelayLine holds its samples: as they are, or in 16- or 24-bit fixed
+// point with full scale 0 dBFS (see pack_s16() and pack_s24()), which takes
+// a half or three quarters of the memory of float samples. Packing quantizes
+// the samples and clips float ones to [-1, 1).
+enum DelayStorage { STORE_NATIVE, STORE_16_BIT, STORE_24_BIT };
+
+// The latency buffer: a ring of a power-of-two number of frames, large
+// enough to hold the maximum delay plus one block. A frame holds one sample
+// of each channel, interleaved.
+//
+// Any block of frames coming out of it is a single contiguous span, without
+// a split at the wrap-around point. Where possible, the ring is mapped twice
+// into adjacent virtual memory (with memfd and two mmaps), so that reading
+// past its end continues at its beginning. Otherwise the buffer has twice the
+// size and every frame is written to both halves.
+//
+// When the delay changes, the output crossfades linearly from the old delay
+// to the new one over fade_length frames, rather than jumping.
+//
+// The frames hold samples of type Sample, stored as storage says. Packed
+// frames are converted a block at a time on the way in and out.
+template <typename Sample>
+class DelayLine {
+  private:
+    unsigned channels;
+    unsigned long max_delay;
+    unsigned long delay;
+    // The delay we are fading from, the one to switch to after the current
+    // fade, and the progress of the fade (fade_pos == fade_length when idle)
+    unsigned long old_delay;
+    unsigned long target_delay;
+    unsigned long fade_length;
+    unsigned long fade_pos;
+    DelayStorage storage;
+    // The size of a stored sample
+    unsigned sample_bytes;
+    // Holds the output during a fade
+    std::vector<Sample> faded;
+    // Hold the frames on their way in and out if they are packed
+    std::vector<Sample> unpacked_in, unpacked_out;
+    // The ring size in frames
+    unsigned long capacity;
+    unsigned long mask;
+    uint8_t *data = nullptr;
+    // Set if data is a double mapping, otherwise data points into allocation
+    bool mirrored = false;
+    void *allocation = nullptr;
+    // The index of the next frame to be written
+    unsigned long pos = 0;
+    static const unsigned long alignment = 64; // a cache line
+    size_t ring_bytes() const {
+      return capacity * channels * sample_bytes;
+    }
+    bool map_mirrored() {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+      size_t bytes = ring_bytes();
+      int fd = memfd_create("noise-gate-delay", MFD_CLOEXEC);
+      if (fd < 0)
+        return false;
+      void *base = MAP_FAILED;
+      if (ftruncate(fd, bytes) == 0) {
+        base = mmap(nullptr, 2 * bytes, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      }
+      if (base != MAP_FAILED) {
+        char *b = static_cast<char *>(base);
+        if (mmap(b, bytes, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+            mmap(b + bytes, bytes, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+          munmap(base, 2 * bytes);
+          base = MAP_FAILED;
+        }
+      }
+      close(fd);
+      if (base == MAP_FAILED)
+        return false;
+      data = static_cast<uint8_t *>(base);
+      mirrored = true;
+      return true;
+#else
+      return false;
+#endif
+    }
+    uint8_t *frame(unsigned long i) const {
+      return data + i * channels * sample_bytes;
+    }
+    // frame(i) for native storage
+    Sample *native_frame(unsigned long i) const {
+      return reinterpret_cast<Sample *>(frame(i));
+    }
+    // Store n interleaved frames into frame i on, packing them if need be
+    void store(const Sample *in, unsigned long i, unsigned long n) {
+      if (storage == STORE_NATIVE)
+        memcpy(frame(i), in, n * channels * sizeof(Sample));
+      else if (storage == STORE_16_BIT)
+        pack_s16(in, reinterpret_cast<int16_t *>(frame(i)), n * channels);
+      else
+        pack_s24(in, frame(i), n * channels);
+    }
+    // The n frames from frame i on: in place if they are stored natively,
+    // otherwise unpacked into out
+    const Sample *load(unsigned long i, unsigned long n, Sample *out) const {
+      switch (storage) {
+      case STORE_NATIVE:
+        return native_frame(i);
+      case STORE_16_BIT:
+        unpack_s16(reinterpret_cast<const int16_t *>(frame(i)), out,
+                   n * channels);
+        break;
+      case STORE_24_BIT:
+        unpack_s24(frame(i), out, n * channels);
+        break;
+      }
+      return out;
+    }
+  public:
+    DelayLine(unsigned channels, unsigned long max_delay,
+              unsigned long max_block, unsigned long fade_length,
+              DelayStorage storage = STORE_NATIVE)
+      : channels(channels), max_delay(max_delay), delay(max_delay),
+        old_delay(max_delay), target_delay(max_delay),
+        fade_length(fade_length), fade_pos(fade_length), storage(storage),
+        sample_bytes(storage == STORE_16_BIT ? 2 :
+                     storage == STORE_24_BIT ? 3 : sizeof(Sample)),
+        faded(max_block * channels)
+      {
+        if (storage != STORE_NATIVE) {
+          unpacked_in.resize(max_block * channels);
+          unpacked_out.resize(max_block * channels);
+        }
+        unsigned long min_capacity = max_delay + max_block;
+#ifdef __unix__
+        // A mapping must consist of whole pages. As capacity is a power of
+        // two, this holds once it times the largest power of two dividing
+        // sample_bytes reaches the page size.
+        min_capacity = std::max(min_capacity,
+                           (unsigned long) sysconf(_SC_PAGESIZE) /
+                           (sample_bytes & -sample_bytes));
+#endif
+        capacity = 1;
+        while (capacity < min_capacity)
+          capacity *= 2;
+        mask = capacity - 1;
+        if (!map_mirrored()) {
+          // zero-filled, like a fresh mapping
+          allocation = calloc(2 * ring_bytes() + alignment, 1);
+          uintptr_t p = reinterpret_cast<uintptr_t>(allocation);
+          data = reinterpret_cast<uint8_t *>((p + alignment - 1) & ~(alignment - 1));
+        }
+      }
+    ~DelayLine() {
+#ifdef __unix__
+      if (mirrored)
+        munmap(data, 2 * ring_bytes());
+#endif
+      free(allocation);
+    }
+    DelayLine(const DelayLine &) = delete;
+    DelayLine &operator=(const DelayLine &) = delete;
+    // Fill the line with silence
+    void reset() {
+      memset(data, 0, (mirrored ? 1 : 2) * ring_bytes());
+      pos = 0;
+      fade_pos = fade_length;
+      old_delay = target_delay = delay;
+    }
+    // Change the delay at once, e.g. before the first push
+    void set_delay(unsigned long new_delay) {
+      delay = old_delay = target_delay = std::min(new_delay, max_delay);
+      fade_pos = fade_length;
+    }
+    // Fade to a new delay. If a fade is in progress, the new one starts after
+    // it.
+    void fade_to_delay(unsigned long new_delay) {
+      target_delay = std::min(new_delay, max_delay);
+    }
+    // Push n <= max_block frames, taking channel c from
+    // inputs[c][offset..offset + n), and return the n interleaved frames that
+    // come out, delayed by the delay. The returned span stays valid until the
+    // next push.
+    const Sample *push(const Sample *const *inputs,
+                            unsigned long offset, unsigned long n) {
+      if (storage != STORE_NATIVE) {
+        interleave(inputs, offset, channels, unpacked_in.data(), n);
+        return push_frames(unpacked_in.data(), n);
+      }
+      if (mirrored) {
+        interleave(inputs, offset, channels, native_frame(pos), n);
+      } else {
+        // Keep both halves identical
+        unsigned long first = std::min(n, capacity - pos);
+        interleave(inputs, offset, channels, native_frame(pos), first);
+        interleave(inputs, offset, channels, native_frame(capacity + pos), first);
+        interleave(inputs, offset + first, channels, native_frame(0), n - first);
+        interleave(inputs, offset + first, channels, native_frame(capacity), n - first);
+      }
+      return advance(n);
+    }
+    // Push n <= max_block frames that are already interleaved, like push()
+    const Sample *push_frames(const Sample *frames, unsigned long n) {
+      if (mirrored) {
+        store(frames, pos, n);
+      } else {
+        unsigned long first = std::min(n, capacity - pos);
+        store(frames, pos, first);
+        store(frames, capacity + pos, first);
+        store(frames + first * channels, 0, n - first);
+        store(frames + first * channels, capacity, n - first);
+      }
+      return advance(n);
+    }
+  private:
+    // Move past the n frames just stored, and return the n frames that come
+    // out
+    const Sample *advance(unsigned long n) {
+      unsigned long start = pos;
+      pos = (pos + n) & mask;
+      if (fade_pos == fade_length && target_delay != delay) {
+        old_delay = delay;
+        delay = target_delay;
+        fade_pos = 0;
+      }
+      const Sample *out = load((start - delay) & mask, n, unpacked_out.data());
+      if (fade_pos == fade_length)
+        return out;
+      // faded is written only after each frame of old_out is read
+      const Sample *old_out = load((start - old_delay) & mask, n, faded.data());
+      for (unsigned long i = 0; i < n; i++) {
+        if (fade_pos < fade_length)
+          fade_pos++;
+        float x = (float) fade_pos / fade_length;
+        for (unsigned long j = i * channels; j < (i + 1) * channels; j++)
+          faded[j] = crossfade(old_out[j], out[j], x);
+      }
+      return faded.data();
+    }
+};
+
+// Control bounds (in ms). Everything is allocated up front for the largest
+// window and attack, so that processing never allocates.
+const LADSPA_Data min_window_ms = 100, max_window_ms = 3000;
+const LADSPA_Data min_attack_ms = 10, max_attack_ms = 200;
+
+// The gates process the host buffer in sub-blocks of at most this many
+// samples, so that their scratch arrays stay in L1 cache.
+const unsigned long block_size = 256;
+
+// The sizes in samples that follow from the window size, the attack and the
+// lookahead (in seconds).
+//
+// The non-silence window that decides on a sample reaches half a window
+// before it and lookahead_samples after it, so the output need only be
+// delayed by the lookahead (plus the attack, for the smoothing window to see
+// the gate open ahead of time). With the full lookahead of half a window,
+// the window is centered on the sample; with less, it is cut short at the
+// end, and the gate opens later.
+struct GateSizes {
+  unsigned half_window_samples;
+  unsigned lookahead_samples;
+  unsigned window_samples;
+  unsigned sm_window_size;
+  unsigned latency_samples;
+};
+
+inline GateSizes gate_sizes(LADSPA_Data window_size, LADSPA_Data attack,
+                            unsigned sample_rate,
+                            LADSPA_Data lookahead = INFINITY) {
+  GateSizes sz;
+  sz.half_window_samples = window_size * sample_rate / 2.f;
+  sz.lookahead_samples = lookahead * sample_rate < sz.half_window_samples ?
+    (unsigned) (lookahead * sample_rate) : sz.half_window_samples;
+  sz.window_samples = sz.half_window_samples + sz.lookahead_samples + 1;
+  sz.sm_window_size = attack * sample_rate;
+  sz.latency_samples = sz.lookahead_samples + sz.sm_window_size;
+  return sz;
+}
+
+// A mono gate on samples of type Sample (int16_t, int32_t or float), for
+// programs that hold PCM audio and call the engine directly rather than
+// through a plugin host. It is the plugin's gate with the peak detector: the
+// detector compares integer magnitudes against an integer threshold and the
+// gain is applied in Q15 fixed point, so the samples are never converted to
+// float, and the latency buffer holds Sample (two bytes per sample for
+// int16_t).
+//
+// Everything is allocated in the constructor. The controls can be changed
+// between calls to run(); a new window size or attack fades the output over
+// to the new latency, as in the plugin.
+template <typename Sample>
+class PcmNoiseGate {
+  public:
+    typedef typename SampleTraits<Sample>::Magnitude Magnitude;
+  private:
+    unsigned sample_rate;
+    // The sizes for the largest window and attack
+    GateSizes largest;
+    MaxWindow<Sample> max_window;
+    BitNonSilenceWindow ns_window;
+    SmoothingWindow sm_window;
+    DelayLine<Sample> buf;
+    GateSizes current;
+    // Has run() been called since the construction or reset()?
+    bool started = false;
+    Magnitude threshold = 0;
+    LADSPA_Data min_nonsilent = 0; // in seconds
+  public:
+    PcmNoiseGate(unsigned sample_rate)
+      : sample_rate(sample_rate),
+        largest(gate_sizes(max_window_ms / 1000, max_attack_ms / 1000,
+                           sample_rate)),
+        max_window(sample_rate * 5e-3),
+        ns_window(largest.window_samples, sample_rate),
+        sm_window(largest.sm_window_size),
+        buf(1, largest.latency_samples, block_size, sample_rate * 10e-3)
+      {
+        set_threshold(-40);
+        set_min_nonsilent(50);
+        set_window(500, 30);
+      }
+    // Open the gate for levels at or above this many dB below full scale
+    void set_threshold(LADSPA_Data db) {
+      threshold = SampleTraits<Sample>::to_magnitude
+        (SampleTraits<Sample>::full_scale() * pow(10.f, db / 20.f));
+    }
+    // The amount of non-silence (in ms) per window that opens the gate
+    void set_min_nonsilent(LADSPA_Data ms) {
+      min_nonsilent = ms / 1000;
+    }
+    // Set the window size, the attack/decay and the lookahead (in ms); the
+    // lookahead is at most half the window, and that by default
+    void set_window(LADSPA_Data window_ms, LADSPA_Data attack_ms,
+                    LADSPA_Data lookahead_ms = INFINITY) {
+      current = gate_sizes(std::min(std::max(window_ms, min_window_ms),
+                                    max_window_ms) / 1000,
+                           std::min(std::max(attack_ms, min_attack_ms),
+                                    max_attack_ms) / 1000,
+                           sample_rate,
+                           std::max(lookahead_ms, 0.f) / 1000);
+      ns_window.set_window_size(current.window_samples);
+      sm_window.set_window_size(current.sm_window_size);
+      if (started)
+        buf.fade_to_delay(current.latency_samples);
+      else
+        buf.set_delay(current.latency_samples);
+    }
+    void set_curve(SmoothingWindow::Curve curve) {
+      sm_window.set_curve(curve);
+    }
+    // The delay (in samples) from the input to the output
+    unsigned long latency() const {
+      return current.latency_samples;
+    }
+    // Start a new stream, keeping the controls
+    void reset() {
+      max_window.reset();
+      ns_window.reset();
+      sm_window.reset();
+      buf.reset();
+      buf.set_delay(current.latency_samples);
+      started = false;
+    }
+    void run(const Sample *input, Sample *output, unsigned long n_samples) {
+      started = true;
+      for (unsigned long start = 0; start < n_samples; start += block_size) {
+        unsigned long n = std::min(block_size, n_samples - start);
+        process_block(input + start, output + start, n);
+      }
+    }
+  private:
+    void process_block(const Sample *input, Sample *output, unsigned long n) {
+      // As in NoiseGate::process_block()
+      Magnitude levels[block_size];
+      uint64_t mask[block_size / 64];
+      bool open[block_size];
+      LADSPA_Data gain[block_size];
+      SmoothingWindow::GainRun runs[block_size];
+      max_window.process(input, levels, n);
+      pack_ge(levels, threshold, mask, n);
+      ns_window.process(mask, min_nonsilent, open, n);
+      unsigned long n_runs = sm_window.process(open, gain, runs, n);
+      const Sample *in = buf.push(&input, 0, n);
+      unsigned long k = 0;
+      for (unsigned long r = 0; r < n_runs; r++) {
+        unsigned long m = runs[r].length;
+        switch (runs[r].kind) {
+        case SmoothingWindow::UNITY_GAIN:
+          memcpy(output + k, in + k, m * sizeof(Sample));
+          break;
+        case SmoothingWindow::ZERO_GAIN:
+          memset(output + k, 0, m * sizeof(Sample));
+          break;
+        case SmoothingWindow::VARYING_GAIN:
+          apply_gain(in + k, gain + k, output + k, m);
+          break;
+        }
+        k += m;
+      }
+    }
+};
+
+#endif
@@ -1,224 +1,1126 @@
 #include <ladspa.h>
 #include "cmt.h"
 #include <cmath>
-#include <deque>
-#include <boost/circular_buffer.hpp>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include "gate.h"
 
 using namespace std;
 
-// A sliding window that maintains its maximum absolute value
-class MaxWindow {
+// A sliding window that maintains the RMS of its samples
+//
+// The sum of squares is split at segment boundaries the same way as the
+// maximum in MaxWindow: the suffix sums of the previous segment plus the
+// prefix sum of the current one. Both start from zero at every segment, so
+// unlike a running sum that adds the new sample and subtracts the oldest one,
+// it does not drift however long the stream is.
+class RmsWindow {
   private:
+    // The size the storage is allocated for
+    unsigned long max_window_size;
     // Window size.
-    deque<LADSPA_Data>::size_type window_size;
-    // Samples within the window.
-    boost::circular_buffer<LADSPA_Data> buf;
-    // Indinces into the whole track (not buf!), corresponding to the decreasing
-    // subsequence of samples within the current window.
-    deque<unsigned long> indices;
-    // Total cumulative number of samples pushed into this window.
-    // Used to convert 'indices' to actual buf indices.
-    unsigned long n_samples = 0;
-    // Get sample value by its absolute index.
-    inline LADSPA_Data get_sample(unsigned long index) const {
-      return buf[buf.size() - (n_samples - index)];
-    }
+    unsigned long window_size;
+    // Squares of the samples in the current segment.
+    vector<LADSPA_Data> segment;
+    // Suffix sums of the previous segment; suffix[window_size] == 0.
+    vector<LADSPA_Data> suffix;
+    // Number of samples in the current segment so far.
+    unsigned long pos = 0;
+    // Sum of the current segment so far.
+    LADSPA_Data prefix = 0;
+    LADSPA_Data last_level = 0;
   public:
-    MaxWindow(deque<LADSPA_Data>::size_type window_size)
-      : window_size(window_size), buf(window_size) {};
-    void push(LADSPA_Data sample) {
-      sample = abs(sample);
-      while (!indices.empty() && get_sample(indices.back()) <= sample) {
-        indices.pop_back();
+    RmsWindow(unsigned long max_window_size)
+      : max_window_size(max(max_window_size, 1ul)),
+        window_size(this->max_window_size),
+        segment(this->window_size), suffix(this->window_size + 1) {};
+    // Change the window size (at most the initial one), forgetting all samples
+    void set_window_size(unsigned long new_window_size) {
+      window_size = min(max(new_window_size, 1ul), max_window_size);
+      reset();
+    }
+    // Forget all samples; the window starts out filled with silence
+    void reset() {
+      fill(suffix.begin(), suffix.end(), 0);
+      pos = 0;
+      prefix = 0;
+      last_level = 0;
+    }
+    LADSPA_Data level() const {
+      return last_level;
+    }
+    unsigned long size() const {
+      return window_size;
+    }
+    // Push a block of samples, storing the level after each one in levels
+    void process(const LADSPA_Data *samples, LADSPA_Data *levels,
+                 unsigned long n) {
+      for (unsigned long i = 0; i < n; ) {
+        unsigned long m = min(n - i, window_size - pos);
+        LADSPA_Data *seg = segment.data() + pos;
+        mul_block(samples + i, samples + i, seg, m);
+        prefix = prefix_sum_block(seg, levels + i, m, prefix);
+        add_block(levels + i, suffix.data() + pos + 1, levels + i, m);
+        sqrt_scale_block(levels + i, 1.f / window_size, levels + i, m);
+        i += m;
+        pos += m;
+        if (pos == window_size)
+          finish_segment();
       }
-      while (!indices.empty() && indices.front() <= n_samples - window_size) {
-        indices.pop_front();
+      if (n > 0)
+        last_level = levels[n - 1];
+    }
+    // Push a block of samples like process(), but without computing their
+    // levels
+    void advance(const LADSPA_Data *samples, unsigned long n) {
+      for (unsigned long i = 0; i < n; ) {
+        unsigned long m = min(n - i, window_size - pos);
+        mul_block(samples + i, samples + i, segment.data() + pos, m);
+        prefix += sum_squares(samples + i, m);
+        i += m;
+        pos += m;
+        if (pos == window_size)
+          finish_segment();
       }
-      indices.push_back(n_samples++);
-      buf.push_back(sample);
+      if (n > 0)
+        last_level = sqrt((prefix + suffix[pos]) / window_size);
     }
-    LADSPA_Data level() const {
-      return get_sample(indices.front());
+  private:
+    void finish_segment() {
+      LADSPA_Data s = 0;
+      for (unsigned long j = window_size; j-- > 0; ) {
+        s += segment[j];
+        suffix[j] = s;
+      }
+      pos = 0;
+      prefix = 0;
     }
 };
 
-// A sliding window that knows at each moment how much non-silence it contains.
+// A peak follower: a one-pole envelope with instant attack and exponential
+// release, as a cheaper stand-in for MaxWindow. Its state is a few floats.
 //
-// The window has the latency ns_window_size.
-class NonSilenceWindow {
+// The level is the largest sample so far, each scaled down by
+// exp(-age / window_size). A peak thus stays above a threshold for as long as
+// it would in a MaxWindow of the same size if it exceeds the threshold by
+// 8.7 dB (a factor of e); a smaller peak releases sooner, a larger one later.
+class PeakFollower {
   private:
-    boost::circular_buffer<bool> buf; // true == non-silent
-    MaxWindow max_window;
-    LADSPA_Data sample_rate;
-    LADSPA_Data level_threshold; // a threshold above which the sound is considered non-silent
-    unsigned long nonsilent_samples = 0;
+    // The release factor per sample, exp(-1 / window_size)
+    LADSPA_Data release;
+    // The release time constant in samples, which need not be whole
+    LADSPA_Data window_size;
+    LADSPA_Data envelope = 0;
   public:
-    NonSilenceWindow(boost::circular_buffer<LADSPA_Data>::capacity_type ns_window_size,
-                     boost::circular_buffer<LADSPA_Data>::capacity_type max_window_size,
-                     LADSPA_Data sample_rate,
-                     LADSPA_Data level_threshold)
-      : buf(ns_window_size), max_window(max_window_size),
-        sample_rate(sample_rate), level_threshold(level_threshold)
-      {};
-    void push(LADSPA_Data sample) {
-      max_window.push(sample);
-      if (buf.full())
-        nonsilent_samples -= buf.front();
-      bool new_nonsilent = max_window.level() >= level_threshold;
-      buf.push_back(new_nonsilent);
-      nonsilent_samples += new_nonsilent;
-    }
-    // Get the total amount of non-silence inside the window in seconds
-    LADSPA_Data nonsilent() const {
-      return nonsilent_samples / sample_rate;
+    PeakFollower(LADSPA_Data window_size) {
+      set_window_size(window_size);
+    }
+    // Change the release time constant, forgetting all samples
+    void set_window_size(LADSPA_Data new_window_size) {
+      window_size = max(new_window_size, 1.f);
+      release = exp(-1.f / window_size);
+      reset();
+    }
+    void reset() {
+      envelope = 0;
+    }
+    LADSPA_Data level() const {
+      return envelope;
+    }
+    // Push a block of samples, storing the level after each one in levels
+    void process(const LADSPA_Data *samples, LADSPA_Data *levels,
+                 unsigned long n) {
+      envelope = follow_block(samples, release, levels, n, envelope);
+      flush();
+    }
+    // Push a block of samples like process(), but without storing their
+    // levels
+    void advance(const LADSPA_Data *samples, unsigned long n) {
+      LADSPA_Data levels[64];
+      for (unsigned long i = 0; i < n; i += 64) {
+        unsigned long m = min(n - i, 64ul);
+        envelope = follow_block(samples + i, release, levels, m, envelope);
+      }
+      flush();
+    }
+  private:
+    // Drop an envelope decayed far below any threshold before it goes
+    // denormal in digital silence.
+    void flush() {
+      if (envelope < 1e-20f)
+        envelope = 0;
     }
 };
 
-// A window that smoothes the transition between the open and closed states of
-// the gate.
-//
-// The state of the gate is represented by a bool: true = open, false = closed.
-//
-// When the gate moves from open to closed (true -> false), the gate closes
-// smoothly after that.
-//
-// When the gate moves from closed to open (false -> true), this event is
-// anticipated ahead of time and the transition is again smoothed.
-//
-// This function could probably be optimized by introducing more states and
-// avoiding multiplications when the gate remains open or closed for a long time.
-class SmoothingWindow {
+// The largest detector hop (in samples)
+const unsigned long max_hop = 128;
+
+// Settings that differ between the plugins registered in init_noise_gate().
+// Passed to NoiseGate through the descriptor's ImplementationData.
+class NoiseGateConfig : public CMT_ImplementationData {
+public:
+  // Use TransitionNonSilenceWindow rather than BitNonSilenceWindow
+  bool transition_window;
+  // The number of audio channels, gated together
+  unsigned channels;
+  // Make the threshold and the non-silent amount ports audio-rate inputs
+  bool audio_rate_controls;
+  // Detect on a separate key input rather than on the gated channels
+  bool key_input;
+  // How the latency buffer holds the delayed audio
+  DelayStorage storage;
+  NoiseGateConfig(bool transition_window, unsigned channels = 1,
+                  bool audio_rate_controls = false, bool key_input = false,
+                  DelayStorage storage = STORE_NATIVE)
+    : transition_window(transition_window), channels(channels),
+      audio_rate_controls(audio_rate_controls), key_input(key_input),
+      storage(storage) {}
+  // The ports are the four detector controls, the inputs, the outputs, the
+  // latency, the curve, the detector hop, the detector kind, the key input if
+  // there is one, the detector filter frequencies and the lookahead.
+  unsigned long input_port(unsigned c) const { return 4 + c; }
+  unsigned long output_port(unsigned c) const { return 4 + channels + c; }
+  unsigned long latency_port() const { return 4 + 2 * channels; }
+  unsigned long curve_port() const { return 5 + 2 * channels; }
+  unsigned long hop_port() const { return 6 + 2 * channels; }
+  unsigned long detector_port() const { return 7 + 2 * channels; }
+  unsigned long key_port() const { return 8 + 2 * channels; }
+  unsigned long highpass_port() const { return 8 + 2 * channels + key_input; }
+  unsigned long lowpass_port() const { return 9 + 2 * channels + key_input; }
+  unsigned long lookahead_port() const { return 10 + 2 * channels + key_input; }
+};
+
+// The most channels a NoiseGateConfig may have
+const unsigned max_channels = 8;
+
+// A filter in front of the detector, which leaves the gated audio alone: a
+// 4th-order Butterworth high-pass and low-pass, each of them optional, as a
+// cascade of biquads. It keeps a state per channel, and runs four channels
+// at a time, one per SIMD lane.
+class DetectorFilter {
   private:
-    const LADSPA_Data floor = 1e-4; // -80 dB
-    unsigned long window_size;
-    // The current scaling factor applied to the sound samples.
-    LADSPA_Data current_coef = 1;
-    // Are we currently rising (true) or falling (false)?
-    bool rising = true;
-    // The number of samples since we've last seen the gate open.
-    // If it's more than the window size, we may begin to decrease the scaling
-    // factor.
-    long unsigned samples_since_open = 0;
-    // factor is initialized in the constructor based on
-    // the window size and then never changes.
-    LADSPA_Data factor;
+    unsigned sample_rate;
+    Biquad stages[max_biquads];
+    unsigned n_stages = 0;
+    // Which of the filters are on
+    bool highpass_on = false, lowpass_on = false;
+    // The states of the stages for each group of four channels
+    float state[(max_channels + 3) / 4][8 * max_biquads] = {};
+    // Append the two sections of a Butterworth high-pass or low-pass
+    void add_butterworth(LADSPA_Data freq, bool highpass) {
+      double w = 2 * M_PI * freq / sample_rate;
+      for (double q : {0.54119610014619698, 1.3065629648763766}) {
+        double alpha = sin(w) / (2 * q), c = cos(w), a0 = 1 + alpha;
+        double b1 = highpass ? -(1 + c) : 1 - c;
+        Biquad &b = stages[n_stages++];
+        b.b0 = b.b2 = fabs(b1) / 2 / a0;
+        b.b1 = b1 / a0;
+        b.a1 = -2 * c / a0;
+        b.a2 = (1 - alpha) / a0;
+      }
+    }
   public:
-    SmoothingWindow(unsigned long window_size)
-      : window_size(window_size),
-        factor(exp(-log(floor)/window_size))
-      {}
-    // Push a new sample (is the gate open?)
-    void push(bool open) {
-      if (open) {
-        samples_since_open = 0;
-        rising = true;
-      } else {
-        samples_since_open++;
-        if (samples_since_open > window_size) {
-          rising = false;
-        }
+    DetectorFilter(unsigned sample_rate) : sample_rate(sample_rate) {}
+    // Set the corner frequencies (in Hz); 0 turns either filter off.
+    // Changing the frequencies keeps the state, but turning a filter on or
+    // off starts the filter afresh.
+    void set(LADSPA_Data highpass_hz, LADSPA_Data lowpass_hz) {
+      bool was_highpass = highpass_on, was_lowpass = lowpass_on;
+      LADSPA_Data top = 0.45f * sample_rate;
+      highpass_on = highpass_hz > 0;
+      lowpass_on = lowpass_hz > 0;
+      n_stages = 0;
+      if (highpass_on)
+        add_butterworth(min(max(highpass_hz, 10.f), top), true);
+      if (lowpass_on)
+        add_butterworth(min(max(lowpass_hz, 10.f), top), false);
+      if (highpass_on != was_highpass || lowpass_on != was_lowpass)
+        reset();
+    }
+    bool enabled() const {
+      return n_stages > 0;
+    }
+    void reset() {
+      memset(state, 0, sizeof state);
+    }
+    // Filter channel c of inputs[c][offset..offset + n) for each c <
+    // channels, and store the largest absolute value across the channels
+    // in out
+    void process(const LADSPA_Data *const *inputs, unsigned long offset,
+                 unsigned channels, LADSPA_Data *out, unsigned long n) {
+      for (unsigned g = 0; g * 4 < channels; g++) {
+        const LADSPA_Data *in[4];
+        unsigned m = min(channels - g * 4, 4u);
+        for (unsigned c = 0; c < m; c++)
+          in[c] = inputs[g * 4 + c] + offset;
+        biquad_peak_block(stages, n_stages, state[g], in, m, out, n, g > 0);
+        // Let the state of a silent input decay to 0 rather than to
+        // denormals.
+        for (float &s : state[g])
+          s = fabs(s) < 1e-20f ? 0 : s;
       }
-      if (rising) {
-        current_coef = min(max(current_coef, floor) * factor, 1.f);
-      } else {
-        current_coef = current_coef / factor;
-        if (current_coef < floor) {
-          current_coef = 0.f;
-        }
+    }
+};
+
+// A four-band Linkwitz-Riley crossover. The band signals are the lanes of
+// a cascade of biquads, all fed with the input:
+//   1. a 4th-order LR low-pass at the middle frequency in lanes 0 and 1 and a
+//      high-pass in lanes 2 and 3;
+//   2. a low-pass and a high-pass at the low frequency in lanes 0 and 1, and
+//      at the high frequency in lanes 2 and 3;
+//   3. the all-pass that the other split in 2 amounts to, so that the bands
+//      stay in phase.
+// The bands then add up to the input passed through three all-passes, with
+// a flat magnitude response.
+class Crossover {
+  public:
+    static const unsigned bands = 4;
+  private:
+    enum Kind { LOWPASS, HIGHPASS, ALLPASS };
+    static const unsigned n_stages = 5;
+    unsigned sample_rate;
+    Biquad4 stages[n_stages];
+    float state[8 * n_stages] = {};
+    // Set lane c of stage k to a 2nd-order Butterworth section, or the
+    // all-pass that a low-pass and high-pass pair of them add up to
+    void set_lane(unsigned k, unsigned c, Kind kind, LADSPA_Data freq) {
+      double w = 2 * M_PI * freq / sample_rate;
+      double alpha = sin(w) / (2 * 0.70710678118654752), cw = cos(w);
+      double a0 = 1 + alpha, b0, b1, b2;
+      switch (kind) {
+      case LOWPASS:
+        b0 = b2 = (1 - cw) / 2;
+        b1 = 1 - cw;
+        break;
+      case HIGHPASS:
+        b0 = b2 = (1 + cw) / 2;
+        b1 = -(1 + cw);
+        break;
+      case ALLPASS:
+        b0 = 1 - alpha;
+        b1 = -2 * cw;
+        b2 = 1 + alpha;
+        break;
+      }
+      Biquad4 &b = stages[k];
+      b.b0[c] = b0 / a0;
+      b.b1[c] = b1 / a0;
+      b.b2[c] = b2 / a0;
+      b.a1[c] = -2 * cw / a0;
+      b.a2[c] = (1 - alpha) / a0;
+    }
+  public:
+    Crossover(unsigned sample_rate) : sample_rate(sample_rate) {}
+    // Set the three crossover frequencies (in Hz, in increasing order),
+    // keeping the state
+    void set(LADSPA_Data low_hz, LADSPA_Data mid_hz, LADSPA_Data high_hz) {
+      LADSPA_Data top = 0.45f * sample_rate;
+      low_hz = min(low_hz, top);
+      mid_hz = min(mid_hz, top);
+      high_hz = min(high_hz, top);
+      for (unsigned k = 0; k < 2; k++) {
+        for (unsigned c = 0; c < bands; c++)
+          set_lane(k, c, c < 2 ? LOWPASS : HIGHPASS, mid_hz);
+        for (unsigned c = 0; c < bands; c++)
+          set_lane(2 + k, c, c % 2 ? HIGHPASS : LOWPASS,
+                   c < 2 ? low_hz : high_hz);
       }
+      for (unsigned c = 0; c < bands; c++)
+        set_lane(4, c, ALLPASS, c < 2 ? high_hz : low_hz);
     }
-    // Get the current scaling factor (with the latency equal to the
-    // attack/decay duration)
-    LADSPA_Data scaling_factor() const {
-      return current_coef;
+    void reset() {
+      memset(state, 0, sizeof state);
+    }
+    // Split n samples into frames of the four band samples
+    void process(const LADSPA_Data *in, LADSPA_Data *frames,
+                 unsigned long n) {
+      biquad_lanes_block(stages, n_stages, state, in, frames, n);
+      for (float &s : state)
+        s = fabs(s) < 1e-20f ? 0 : s;
     }
 };
 
-const unsigned long port_count = 7;
+// MaxWindow for the frames of a Crossover: the level of each band, one band
+// per lane. Its levels are those of a MaxWindow<LADSPA_Data> per band.
+class BandMaxWindow {
+  private:
+    static const unsigned bands = Crossover::bands;
+    static_assert(bands == 4, "the window keeps one band per SIMD lane");
+    unsigned long window_size;
+    // As in MaxWindow, with a frame of the four bands for each sample
+    vector<LADSPA_Data> segment;
+    vector<LADSPA_Data> suffix;
+    unsigned long pos = 0;
+    LADSPA_Data prefix[bands] = {};
+    unsigned long n_samples = 0;
+    void finish_segment() {
+      suffix_max4_block(segment.data(), suffix.data(), window_size);
+      pos = 0;
+      fill(prefix, prefix + bands, 0.f);
+    }
+  public:
+    BandMaxWindow(unsigned long window_size)
+      : window_size(max(window_size, 1ul)),
+        segment(bands * this->window_size),
+        suffix(bands * (this->window_size + 1)) {}
+    void reset() {
+      fill(segment.begin(), segment.end(), 0.f);
+      fill(suffix.begin(), suffix.end(), 0.f);
+      pos = 0;
+      fill(prefix, prefix + bands, 0.f);
+      n_samples = 0;
+    }
+    // Push n frames, storing the levels after each one in the frames of
+    // levels
+    void process(const LADSPA_Data *frames, LADSPA_Data *levels,
+                 unsigned long n) {
+      unsigned long i = 0;
+      for (; i < n && n_samples < window_size - 1; i++, n_samples++) {
+        abs_block(frames + bands * i, levels + bands * i, bands);
+        fill_n(segment.data() + bands * pos, bands, 0.f);
+        if (++pos == window_size)
+          finish_segment();
+      }
+      while (i < n) {
+        unsigned long m = min(n - i, window_size - pos);
+        LADSPA_Data *seg = segment.data() + bands * pos;
+        abs_block(frames + bands * i, seg, bands * m);
+        prefix_max4_block(seg, prefix, levels + bands * i, m);
+        max_block(levels + bands * i, suffix.data() + bands * (pos + 1),
+                  levels + bands * i, bands * m);
+        i += m;
+        n_samples += m;
+        pos += m;
+        if (pos == window_size)
+          finish_segment();
+      }
+    }
+};
 
-class NoiseGate : public CMT_PluginInstance {
+// What NoiseGate and MultibandNoiseGate share: the four detector controls
+// (ports 0 to 3) and the window sizes and threshold derived from them.
+class GateInstance : public CMT_PluginInstance {
 public:
   unsigned sample_rate;
-  unique_ptr<NonSilenceWindow> ns_window;
+
+  // Set once the window sizes and the threshold have been taken from the
+  // ports after activation; until then they are applied at once rather than
+  // faded or interpolated to.
+  bool configured = false;
+  // The window sizes currently in effect
+  GateSizes current{};
+
+  // The control values as last read from the ports. The values derived from
+  // them are only recomputed when they change.
+  LADSPA_Data threshold_db, window_ms, attack_ms, lookahead_ms, min_nonsilent_ms;
+  LADSPA_Data level_threshold;
+  // The threshold we are moving to, in the linear domain
+  LADSPA_Data target_threshold;
+  // The threshold changes by this much per sample within the current run()
+  LADSPA_Data threshold_step = 0;
+  LADSPA_Data min_nonsilent; // in seconds
+
+  GateInstance(unsigned long port_count, unsigned sample_rate)
+    : CMT_PluginInstance(port_count), sample_rate(sample_rate) {}
+
+  // Take all the controls from the ports on the next run()
+  void forget_controls() {
+    configured = false;
+    // NaN compares unequal to any port value
+    threshold_db = window_ms = attack_ms = lookahead_ms = min_nonsilent_ms = NAN;
+  }
+
+  // Read the threshold and the non-silent amount
+  void read_threshold_ports() {
+    if (*(m_ppfPorts[0]) != threshold_db) {
+      threshold_db = *(m_ppfPorts[0]);
+      target_threshold = pow(10.f, threshold_db / 20.f);
+    }
+    if (*(m_ppfPorts[2]) != min_nonsilent_ms) {
+      min_nonsilent_ms = *(m_ppfPorts[2]);
+      min_nonsilent = min_nonsilent_ms / 1000; // in seconds
+    }
+  }
+
+  // Read the window size and the attack, and the lookahead (in ms) if the
+  // gate has one, into current. Return whether the windows must be set to
+  // current: always until the gate is configured, and afterwards when the
+  // sizes have changed, in which case the latency should fade over.
+  bool read_size_ports(LADSPA_Data lookahead = INFINITY) {
+    if (*(m_ppfPorts[1]) == window_ms && *(m_ppfPorts[3]) == attack_ms &&
+        lookahead == lookahead_ms)
+      return false;
+    window_ms = *(m_ppfPorts[1]);
+    attack_ms = *(m_ppfPorts[3]);
+    lookahead_ms = lookahead;
+    GateSizes sz =
+      gate_sizes(min(max(window_ms, min_window_ms), max_window_ms) / 1000,
+                 min(max(attack_ms, min_attack_ms), max_attack_ms) / 1000,
+                 sample_rate, max(lookahead_ms, 0.f) / 1000);
+    bool changed = sz.window_samples != current.window_samples ||
+                   sz.sm_window_size != current.sm_window_size ||
+                   sz.latency_samples != current.latency_samples;
+    current = sz;
+    return !configured || changed;
+  }
+
+  // The curve selected on a curve port
+  SmoothingWindow::Curve read_curve(unsigned long port) const {
+    int curve = lrintf(*(m_ppfPorts[port]));
+    return (SmoothingWindow::Curve)
+      min(max(curve, (int) SmoothingWindow::EXPONENTIAL),
+          (int) SmoothingWindow::EQUAL_POWER);
+  }
+
+  // A new threshold is reached by the end of a run() of n_samples, linearly,
+  // so that automating it does not produce steps; the first one after
+  // activation is taken at once. Call end_threshold_ramp() after the run.
+  void start_threshold_ramp(unsigned long n_samples) {
+    if (!configured) {
+      level_threshold = target_threshold;
+      configured = true;
+    } else if (target_threshold != level_threshold && n_samples > 0) {
+      threshold_step = (target_threshold - level_threshold) / n_samples;
+    }
+  }
+
+  void end_threshold_ramp() {
+    if (threshold_step != 0) {
+      level_threshold = target_threshold;
+      threshold_step = 0;
+    }
+  }
+};
+
+class NoiseGate : public GateInstance {
+public:
+  const NoiseGateConfig *config;
+  // What the detector measures over its 5 ms window
+  enum Detector { PEAK, RMS, FOLLOWER };
+  Detector detector = PEAK;
+  unique_ptr<MaxWindow<LADSPA_Data>> max_window;
+  unique_ptr<RmsWindow> rms_window;
+  unique_ptr<PeakFollower> follower;
+  // The non-silence window in use: transition_ns_window if there is one and
+  // the detector is PEAK, bit_ns_window otherwise. TransitionNonSilenceWindow
+  // is sized for non-silent runs at least as long as the level window, which
+  // only the peak detector guarantees; near the threshold, the RMS and peak
+  // follower levels can cross it every few samples.
+  NonSilenceWindow *ns_window = nullptr;
+  unique_ptr<NonSilenceWindow> bit_ns_window;
+  unique_ptr<NonSilenceWindow> transition_ns_window;
   unique_ptr<SmoothingWindow>  sm_window;
-  unique_ptr<boost::circular_buffer<LADSPA_Data>> buf;
+  unique_ptr<DelayLine<LADSPA_Data>> buf;
+  unique_ptr<DetectorFilter> filter;
+
+  // The detector filter frequencies as last read from the ports
+  LADSPA_Data highpass_hz, lowpass_hz;
+
+  // The decimated detector: with hop > 1, the level window and ns_window work
+  // on one level per hop samples, and each decision holds for the next hop.
+  unsigned long hop = 1;
+  // The peak (for the RMS detector, the sum of squares) and the number of
+  // samples of the current hop so far
+  LADSPA_Data hop_peak = 0;
+  unsigned long hop_fill = 0;
+  // The decision of the last complete hop
+  bool hop_open = false;
+
+  // The number of samples since the last one at or above level_threshold,
+  // up to the level window size, if known; see detect_bulk()
+  unsigned long loud_age = 0;
+  bool loud_age_known = false;
 
   // NB: we cannot do much initialization in the constructor because the ports
   // may be connected after it is called.
-  NoiseGate(const LADSPA_Descriptor *,
+  NoiseGate(const LADSPA_Descriptor *desc,
             unsigned sample_rate)
-    : CMT_PluginInstance(port_count), sample_rate(sample_rate) {}
+    : GateInstance(desc->PortCount, sample_rate),
+      config(static_cast<const NoiseGateConfig *>(desc->ImplementationData)) {}
+
+  // Allocate everything on the first call; afterwards just reset the state,
+  // so that a host can reuse the instance for a new stream.
+  void activate() {
+    forget_controls();
+    highpass_hz = lowpass_hz = NAN;
+    if (max_window != nullptr) {
+      set_hop(1);
+      sm_window->reset();
+      buf->reset();
+      filter->reset();
+      return;
+    }
+    GateSizes sz = gate_sizes(max_window_ms / 1000, max_attack_ms / 1000,
+                              sample_rate);
+    max_window = make_unique<MaxWindow<LADSPA_Data>>(sample_rate * 5e-3);
+    rms_window = make_unique<RmsWindow>(sample_rate * 5e-3);
+    follower = make_unique<PeakFollower>(sample_rate * 5e-3);
+    bit_ns_window = make_unique<BitNonSilenceWindow>(sz.window_samples, sample_rate);
+    if (config->transition_window) {
+      transition_ns_window = make_unique<TransitionNonSilenceWindow>
+        (sz.window_samples, sample_rate, sample_rate * 5e-3, block_size);
+    }
+    select_ns_window();
+    sm_window = make_unique<SmoothingWindow>(sz.sm_window_size);
+    // The buffer starts out silent, and so does the output until the first
+    // input sample comes out of it.
+    buf = make_unique<DelayLine<LADSPA_Data>>(config->channels,
+                                              sz.latency_samples, block_size,
+                                              sample_rate * 10e-3,
+                                              config->storage);
+    filter = make_unique<DetectorFilter>(sample_rate);
+  }
+
+  // Switch the detector to a new hop, starting it afresh; also used when the
+  // detector kind changes. The non-silence
+  // window size must be set after this.
+  void set_hop(unsigned long new_hop) {
+    hop = new_hop;
+    unsigned long level_window = sample_rate * 5e-3;
+    max_window->set_window_size((level_window + hop / 2) / hop);
+    rms_window->set_window_size((level_window + hop / 2) / hop);
+    // The follower's decay is not rounded to whole hops, as the error would
+    // grow with the time the level takes to decay to the threshold.
+    follower->set_window_size((LADSPA_Data) level_window / hop);
+    select_ns_window();
+    ns_window->reset();
+    ns_window->set_sample_rate((LADSPA_Data) sample_rate / hop);
+    hop_peak = 0;
+    hop_fill = 0;
+    hop_open = false;
+    // Unlike max_window (see MaxWindow::process()), rms_window starts out
+    // full of silence.
+    loud_age = rms_window->size();
+    loud_age_known = detector == RMS;
+  }
+
+  void select_ns_window() {
+    ns_window = transition_ns_window != nullptr && detector == PEAK ?
+      transition_ns_window.get() : bit_ns_window.get();
+  }
+
+  // Set the non-silence window to the current window size, in hops
+  void update_ns_window_size() {
+    ns_window->set_window_size(max((current.window_samples + hop / 2) / hop, 1ul));
+  }
 
   void run(unsigned long n_samples) {
 
-    LADSPA_Data threshold     = pow(10.f, *(m_ppfPorts[0]) / 20.f);
-    LADSPA_Data window_size   = *(m_ppfPorts[1]) / 1000; // in seconds
-    LADSPA_Data min_nonsilent = *(m_ppfPorts[2]) / 1000; // in seconds
-    LADSPA_Data attack        = *(m_ppfPorts[3]) / 1000; // in seconds
-    LADSPA_Data *input        = m_ppfPorts[4];
-    LADSPA_Data *output       = m_ppfPorts[5];
-    LADSPA_Data *latency      = m_ppfPorts[6];
+    LADSPA_Data *latency      = m_ppfPorts[config->latency_port()];
+    const LADSPA_Data *inputs[max_channels];
+    LADSPA_Data *outputs[max_channels];
+    for (unsigned c = 0; c < config->channels; c++) {
+      inputs[c] = m_ppfPorts[config->input_port(c)];
+      outputs[c] = m_ppfPorts[config->output_port(c)];
+    }
+
+    // With audio-rate controls, process_block() reads ports 0 and 2 itself.
+    if (!config->audio_rate_controls)
+      read_threshold_ports();
+    if (read_size_ports(*(m_ppfPorts[config->lookahead_port()]))) {
+      // The windows keep their history across a resize, and the output
+      // fades over to the new latency.
+      update_ns_window_size();
+      sm_window->set_window_size(current.sm_window_size);
+      if (configured)
+        buf->fade_to_delay(current.latency_samples);
+      else
+        buf->set_delay(current.latency_samples);
+    }
+    unsigned long new_hop = min(max(lrintf(*(m_ppfPorts[config->hop_port()])), 1l),
+                                (long) max_hop);
+    Detector new_detector = (Detector)
+      min(max(lrintf(*(m_ppfPorts[config->detector_port()])), (long) PEAK),
+          (long) FOLLOWER);
+    if (new_hop != hop || new_detector != detector) {
+      detector = new_detector;
+      set_hop(new_hop);
+      update_ns_window_size();
+    }
+    *latency = current.latency_samples;
+    if (*(m_ppfPorts[config->highpass_port()]) != highpass_hz ||
+        *(m_ppfPorts[config->lowpass_port()]) != lowpass_hz) {
+      highpass_hz = *(m_ppfPorts[config->highpass_port()]);
+      lowpass_hz = *(m_ppfPorts[config->lowpass_port()]);
+      filter->set(highpass_hz, lowpass_hz);
+    }
+
+    // Audio-rate thresholds are read sample by sample instead, and
+    // target_threshold is never set.
+    if (config->audio_rate_controls)
+      configured = true;
+    else
+      start_threshold_ramp(n_samples);
+    sm_window->set_curve(read_curve(config->curve_port()));
+    // Hosts mostly call us with a fixed power-of-two block size; use a
+    // kernel specialized for it when there is one.
+    if (n_samples == 64) {
+      process_block<64>(inputs, outputs, 0, 64);
+    } else if (n_samples == 128) {
+      process_block<128>(inputs, outputs, 0, 128);
+    } else if (n_samples % block_size == 0) {
+      for (unsigned long start = 0; start < n_samples; start += block_size)
+        process_block<block_size>(inputs, outputs, start, block_size);
+    } else {
+      for (unsigned long start = 0; start < n_samples; start += block_size) {
+        unsigned long n = min(block_size, n_samples - start);
+        process_block<0>(inputs, outputs, start, n);
+      }
+    }
+    end_threshold_ramp();
+  }
+
+  // Run each processing stage over the whole sub-block
+  // [offset, offset + n) before moving on to the next one.
+  //
+  // If N is not 0, n must be equal to it; the length of the sub-block is then
+  // known at compile time, so that the fixed-length loops can be unrolled.
+  template <unsigned long N>
+  void process_block(const LADSPA_Data *const *inputs,
+                     LADSPA_Data *const *outputs, unsigned long offset,
+                     unsigned long n_) {
+    const unsigned long n = N ? N : n_;
+    const unsigned long size = N ? N : block_size;
+    // Scratch arrays for the processing stages:
+    // peak:   the largest absolute (filtered) sample across the channels
+    // open:   is there enough non-silence in the window to open the gate?
+    // gain:   the smoothed scaling factor
+    // runs:   the runs of constant or ramping gain
+    LADSPA_Data peak[size];
+    bool open[size];
+    LADSPA_Data gain[size];
+    SmoothingWindow::GainRun runs[size];
+
+    // All channels share one detector, fed with the key input if there is
+    // one and with their largest (filtered) sample otherwise.
+    const LADSPA_Data *const *detected = inputs;
+    unsigned n_detected = config->channels;
+    const LADSPA_Data *key;
+    if (config->key_input) {
+      key = m_ppfPorts[config->key_port()];
+      detected = &key;
+      n_detected = 1;
+    }
+    const LADSPA_Data *detector_input = detected[0] + offset;
+    if (filter->enabled()) {
+      filter->process(detected, offset, n_detected, peak, n);
+      detector_input = peak;
+    } else if (n_detected > 1) {
+      abs_block(detector_input, peak, n);
+      for (unsigned c = 1; c < n_detected; c++)
+        max_abs_block(detected[c] + offset, peak, n);
+      detector_input = peak;
+    }
+    if (hop == 1) {
+      if (!detect_bulk<N>(detector_input, n, open)) {
+        // levels: the level over the last 5 ms
+        LADSPA_Data levels[size];
+        detect_levels(detector_input, levels, n);
+        decide<N>(levels, offset, nullptr, n, open);
+      }
+    } else {
+      detect_hops<N>(detector_input, offset, n, open);
+    }
+    unsigned long n_runs = sm_window->process(open, gain, runs, n);
+    unsigned channels = config->channels;
+    const LADSPA_Data *in = buf->push(inputs, offset, n);
+    LADSPA_Data *out[max_channels];
+    for (unsigned c = 0; c < channels; c++)
+      out[c] = outputs[c] + offset;
+    unsigned long k = 0;
+    for (unsigned long r = 0; r < n_runs; r++) {
+      unsigned long m = runs[r].length;
+      switch (runs[r].kind) {
+      case SmoothingWindow::UNITY_GAIN:
+        deinterleave(in, channels, nullptr, out, m);
+        break;
+      case SmoothingWindow::ZERO_GAIN:
+        for (unsigned c = 0; c < channels; c++)
+          memset(out[c], 0, m * sizeof(LADSPA_Data));
+        break;
+      case SmoothingWindow::VARYING_GAIN:
+        deinterleave(in, channels, gain + k, out, m);
+        break;
+      }
+      for (unsigned c = 0; c < channels; c++)
+        out[c] += m;
+      in += m * channels;
+      k += m;
+    }
+  }
 
-    unsigned half_window_samples = window_size * sample_rate / 2.f;
-    unsigned window_samples = 2 * half_window_samples + 1;
-    unsigned sm_window_size = attack * sample_rate;
-    unsigned latency_samples = half_window_samples + sm_window_size;
-    *latency = latency_samples;
+  // Push samples through the level window of the selected detector, storing
+  // the level after each one in levels
+  void detect_levels(const LADSPA_Data *x, LADSPA_Data *levels,
+                     unsigned long n) {
+    switch (detector) {
+    case PEAK:
+      max_window->process(x, levels, n);
+      break;
+    case RMS:
+      rms_window->process(x, levels, n);
+      break;
+    case FOLLOWER:
+      follower->process(x, levels, n);
+      break;
+    }
+  }
 
-    if (ns_window == nullptr) {
-      ns_window = make_unique<NonSilenceWindow>(window_samples,
-                                                 sample_rate * 5e-3,
-                                                 sample_rate,
-                                                 threshold);
+  // If the level stays below the threshold throughout the sub-block (the
+  // sub-block and the level window before it are quiet), or at or above it
+  // (no level window's worth of quiet samples in a row), push the flags to
+  // ns_window in bulk and return true. The levels themselves are not
+  // computed then, and max_window merely advances.
+  //
+  // Finding this out takes a pass for the peak of the sub-block and, if it
+  // is above the threshold, one for the loud samples, whose runs are
+  // scanned word by word; this also keeps loud_age up to date.
+  //
+  // The RMS level never exceeds the peak level, so a quiet sub-block is
+  // quiet for the RMS detector too; it only needs loud_age to know that the
+  // level window before it is. The peak follower stays quiet through a quiet
+  // sub-block if it starts out quiet. A loud sub-block takes the full path
+  // with either.
+  template <unsigned long N>
+  bool detect_bulk(const LADSPA_Data *x, unsigned long n, bool *open) {
+    if (config->audio_rate_controls || threshold_step != 0 ||
+        (detector == PEAK && !max_window->filled())) {
+      loud_age_known = false;
+      return false;
     }
-    if (sm_window == nullptr) {
-      sm_window = make_unique<SmoothingWindow>(sm_window_size);
+    const unsigned long size = N ? N : block_size;
+    unsigned long level_window = max_window->size();
+    bool flag;
+    if (max_abs(x, n) < level_threshold) {
+      bool quiet_before = detector == RMS ?
+        loud_age_known && loud_age + 1 >= level_window :
+        (detector == PEAK ? max_window->level() : follower->level()) <
+          level_threshold;
+      if (loud_age_known)
+        loud_age = min(loud_age + n, level_window);
+      if (!quiet_before)
+        return false;
+      // Nothing loud within the level window before the sub-block either
+      loud_age = level_window;
+      loud_age_known = true;
+      flag = false;
+    } else {
+      // loud: is the sample at or above the threshold?
+      uint64_t loud[size / 64];
+      pack_abs_ge(x, level_threshold, loud, n);
+      unsigned long first = find_bit(loud, 0, n, true);
+      bool all_loud = loud_age_known && loud_age + first < level_window;
+      // Check every run of quiet samples; end is one past the last loud
+      // sample found so far.
+      unsigned long end = first;
+      for (;;) {
+        unsigned long quiet = find_bit(loud, end, n, false);
+        if (quiet == n) {
+          end = n;
+          break;
+        }
+        unsigned long next = find_bit(loud, quiet, n, true);
+        if (next == n) {
+          end = quiet;
+          break;
+        }
+        all_loud = all_loud && next - quiet < level_window;
+        end = next;
+      }
+      loud_age = min(n - end, level_window);
+      loud_age_known = true;
+      if (detector != PEAK || !all_loud || loud_age == level_window)
+        return false;
+      flag = true;
     }
-    if (buf == nullptr) {
-      buf = make_unique<boost::circular_buffer<LADSPA_Data>>(latency_samples);
+    switch (detector) {
+    case PEAK:
+      max_window->advance(x, n);
+      break;
+    case RMS:
+      rms_window->advance(x, n);
+      break;
+    case FOLLOWER:
+      follower->advance(x, n);
+      break;
     }
-    for (unsigned i = 0; i < n_samples; i++) {
-      // save the sample so we don't lose it after writing to output[i]
-      LADSPA_Data sample = input[i];
-      ns_window->push(sample);
-      sm_window->push(ns_window->nonsilent() >= min_nonsilent);
-      if (buf->full()) {
-        output[i] = buf->front() * sm_window->scaling_factor();
+    uint64_t mask[size / 64];
+    for (unsigned long w = 0; w * 64 < n; w++)
+      mask[w] = flag ? ~0ull : 0;
+    ns_window->process(mask, min_nonsilent, open, n);
+    return true;
+  }
+
+  // Decide for n detector steps whether the gate should be open, given their
+  // levels. Step i reads the controls at sample i of the sub-block starting
+  // at offset, or at sample at[i] if at is given.
+  template <unsigned long N>
+  void decide(const LADSPA_Data *levels, unsigned long offset,
+              const unsigned long *at, unsigned long n, bool *open) {
+    const unsigned long size = N ? N : block_size;
+    // mask:   is the level above the threshold?
+    // threshold, count: the per-step threshold and non-silence count, with
+    //         audio-rate controls or a decimated detector
+    uint64_t mask[size / 64] = {};
+    LADSPA_Data threshold[size];
+    unsigned long count[size];
+    if (config->audio_rate_controls) {
+      const LADSPA_Data *threshold_db = m_ppfPorts[0] + offset;
+      const LADSPA_Data *min_nonsilent_ms = m_ppfPorts[2] + offset;
+      if (at) {
+        for (unsigned long i = 0; i < n; i++)
+          threshold[i] = threshold_db[at[i]];
+        threshold_db = threshold;
+      }
+      db_to_gain_block(threshold_db, threshold, n);
+      pack_ge_block(levels, threshold, mask, n);
+      ns_window->counts(mask, count, n);
+      // min_count() caches its last result, so a steady or slowly moving
+      // control costs a comparison per sample.
+      for (unsigned long i = 0; i < n; i++) {
+        LADSPA_Data ms = min_nonsilent_ms[at ? at[i] : i];
+        open[i] = count[i] >= ns_window->min_count(ms / 1000);
+      }
+    } else {
+      if (threshold_step == 0) {
+        pack_ge(levels, level_threshold, mask, n);
+      } else if (!at) {
+        pack_ge_ramp(levels, level_threshold + threshold_step * offset,
+                     threshold_step, mask, n);
+      } else {
+        for (unsigned long i = 0; i < n; i++)
+          threshold[i] = level_threshold + threshold_step * (offset + at[i] + 1);
+        pack_ge_block(levels, threshold, mask, n);
       }
-      else {
-        output[i] = 0;
+      ns_window->process(mask, min_nonsilent, open, n);
+    }
+  }
+
+  // The decimated detector. Each hop is reduced to its peak (or RMS); when a
+  // hop is complete, that goes through the level window and ns_window, and
+  // the decision holds from the end of that hop to the end of the next one.
+  // The RMS of the hop RMS values is the RMS over the whole hops, so the RMS
+  // detector only loses the rounding of its window to whole hops.
+  //
+  // Compared to the full-rate detector, the level window and the non-silence
+  // window are rounded to whole hops, and so is every non-silent stretch, so
+  // the amount of non-silence is off by up to 1.5 hops per stretch within the
+  // window (these errors mostly cancel out). The decision then lags by up to
+  // a hop. With one stretch in the window, the gate thus opens or closes at
+  // most 2.5 hops early or late; when the amount of non-silence hovers around
+  // min_nonsilent, an edge can move further.
+  template <unsigned long N>
+  void detect_hops(const LADSPA_Data *x, unsigned long offset,
+                   unsigned long n, bool *open) {
+    const unsigned long size = N ? N : block_size;
+    // peaks, levels: the peak (RMS) of each hop completed in this sub-block
+    //                and the level over the last 5 ms after it
+    // at:            the last sample of each such hop
+    // decided:       the decision after each such hop
+    LADSPA_Data peaks[size], levels[size];
+    unsigned long at[size];
+    bool decided[size];
+    unsigned long n_hops = 0;
+    for (unsigned long i = 0; i < n; ) {
+      unsigned long m = min(n - i, hop - hop_fill);
+      if (detector == RMS)
+        hop_peak += sum_squares(x + i, m);
+      else
+        hop_peak = max(hop_peak, max_abs(x + i, m));
+      i += m;
+      hop_fill += m;
+      if (hop_fill == hop) {
+        peaks[n_hops] = detector == RMS ? sqrt(hop_peak / hop) : hop_peak;
+        at[n_hops] = i - 1;
+        n_hops++;
+        hop_peak = 0;
+        hop_fill = 0;
       }
-      buf->push_back(sample);
     }
+    if (n_hops > 0) {
+      detect_levels(peaks, levels, n_hops);
+      decide<N>(levels, offset, at, n_hops, decided);
+    }
+    unsigned long i = 0;
+    for (unsigned long j = 0; j < n_hops; j++) {
+      memset(open + i, hop_open, at[j] + 1 - i);
+      hop_open = decided[j];
+      i = at[j] + 1;
+    }
+    memset(open + i, hop_open, n - i);
   }
 
   void run_noise_gate(LADSPA_Handle Instance, unsigned long SampleCount);
 };
 
+void activate_noise_gate(LADSPA_Handle handle) {
+  static_cast<NoiseGate *>(handle)->activate();
+}
+
 void run_noise_gate (LADSPA_Handle handle,
                      unsigned long n_samples) {
   NoiseGate *ng = static_cast<NoiseGate *>(handle);
 
   ng->run(n_samples);
 }
-void init_noise_gate() {
-  CMT_Descriptor *desc = new CMT_Descriptor
-    (5581,
-     "noise_gate",
-     0, // Properties
-     "Roman's Noise Gate",
-     "Roman Cheplyaka",
-     "(c) Roman Cheplyaka 2018",
-     nullptr, // ImplementationData
-     CMT_Instantiate<NoiseGate>,
-     nullptr, // activate
-     run_noise_gate,
-     nullptr, // run_adding
-     nullptr, // set_run_adding_gain
-     nullptr  // deactivate TODO we need to clear the buffers/windows
-     );
+// A gate that splits its input into four bands with a Crossover and gates
+// each band on its own, with the peak detector, non-silence window and
+// smoothing window of NoiseGate. The bands go through one delay line
+// together, as the channels of its frames, and are then mixed back with their
+// gains.
+class MultibandNoiseGate : public GateInstance {
+public:
+  static const unsigned bands = Crossover::bands;
+  // The ports are the four detector controls as in NoiseGate, the input, the
+  // output, the latency, the curve and the crossover frequencies.
+  enum Port {
+    INPUT_PORT = 4, OUTPUT_PORT, LATENCY_PORT, CURVE_PORT, CROSSOVER_PORT
+  };
+  struct Band {
+    unique_ptr<NonSilenceWindow> ns_window;
+    unique_ptr<SmoothingWindow> sm_window;
+  };
+  Band band[bands];
+  unique_ptr<Crossover> crossover;
+  // The levels of all the bands at once; the windows after it run per band
+  unique_ptr<BandMaxWindow> max_window;
+  unique_ptr<DelayLine<LADSPA_Data>> buf;
+
+  // The crossover frequencies as last read from the ports
+  LADSPA_Data crossover_hz[bands - 1];
+
+  MultibandNoiseGate(const LADSPA_Descriptor *desc,
+                     unsigned sample_rate)
+    : GateInstance(desc->PortCount, sample_rate) {}
+
+  void activate() {
+    forget_controls();
+    for (LADSPA_Data &hz : crossover_hz)
+      hz = NAN;
+    if (buf != nullptr) {
+      max_window->reset();
+      for (Band &b : band) {
+        b.ns_window->reset();
+        b.sm_window->reset();
+      }
+      crossover->reset();
+      buf->reset();
+      return;
+    }
+    GateSizes sz = gate_sizes(max_window_ms / 1000, max_attack_ms / 1000,
+                              sample_rate);
+    max_window = make_unique<BandMaxWindow>(sample_rate * 5e-3);
+    for (Band &b : band) {
+      b.ns_window = make_unique<BitNonSilenceWindow>(sz.window_samples,
+                                                     sample_rate);
+      b.sm_window = make_unique<SmoothingWindow>(sz.sm_window_size);
+    }
+    crossover = make_unique<Crossover>(sample_rate);
+    buf = make_unique<DelayLine<LADSPA_Data>>(bands, sz.latency_samples,
+                                              block_size, sample_rate * 10e-3);
+  }
+
+  void run(unsigned long n_samples) {
+    const LADSPA_Data *input = m_ppfPorts[INPUT_PORT];
+    LADSPA_Data *output = m_ppfPorts[OUTPUT_PORT];
+
+    read_threshold_ports();
+    if (read_size_ports()) {
+      for (Band &b : band) {
+        b.ns_window->set_window_size(current.window_samples);
+        b.sm_window->set_window_size(current.sm_window_size);
+      }
+      if (configured)
+        buf->fade_to_delay(current.latency_samples);
+      else
+        buf->set_delay(current.latency_samples);
+    }
+    bool crossover_changed = false;
+    for (unsigned k = 0; k < bands - 1; k++) {
+      if (*(m_ppfPorts[CROSSOVER_PORT + k]) != crossover_hz[k]) {
+        crossover_hz[k] = *(m_ppfPorts[CROSSOVER_PORT + k]);
+        crossover_changed = true;
+      }
+    }
+    if (crossover_changed)
+      crossover->set(crossover_hz[0], crossover_hz[1], crossover_hz[2]);
+    *(m_ppfPorts[LATENCY_PORT]) = current.latency_samples;
+
+    start_threshold_ramp(n_samples);
+    for (Band &b : band)
+      b.sm_window->set_curve(read_curve(CURVE_PORT));
+    for (unsigned long start = 0; start < n_samples; start += block_size) {
+      unsigned long n = min(block_size, n_samples - start);
+      process_block(input, output, start, n);
+    }
+    end_threshold_ramp();
+  }
+
+  void process_block(const LADSPA_Data *input, LADSPA_Data *output,
+                     unsigned long offset, unsigned long n) {
+    static_assert(bands == 4, "mix4() mixes four bands");
+    // frames:  the band samples of each input sample
+    // levels:  the peak level of each band over the last 5 ms, as frames
+    // mask:    is the level of a band above the threshold?
+    // open:    is there enough non-silence in the window to open the gate?
+    // gain:    the smoothed scaling factor of each band
+    // runs:    the runs of constant or ramping gain
+    LADSPA_Data frames[bands * block_size];
+    LADSPA_Data levels[bands * block_size];
+    uint64_t mask[bands][block_size / 64];
+    bool open[block_size];
+    LADSPA_Data gain[bands][block_size];
+    SmoothingWindow::GainRun runs[block_size];
+
+    crossover->process(input + offset, frames, n);
+    const LADSPA_Data *gains[bands];
+    uint64_t *band_masks[bands];
+    for (unsigned b = 0; b < bands; b++) {
+      gains[b] = gain[b];
+      band_masks[b] = mask[b];
+    }
+    max_window->process(frames, levels, n);
+    // With no step, the thresholds are those of pack_ge()
+    pack_ge_ramp4(levels,
+                  threshold_step == 0 ? level_threshold :
+                  level_threshold + threshold_step * offset,
+                  threshold_step, band_masks, n);
+    for (unsigned b = 0; b < bands; b++) {
+      band[b].ns_window->process(mask[b], min_nonsilent, open, n);
+      unsigned long n_runs = band[b].sm_window->process(open, gain[b], runs, n);
+      // mix4() takes the gain of every sample
+      unsigned long k = 0;
+      for (unsigned long r = 0; r < n_runs; r++) {
+        if (runs[r].kind != SmoothingWindow::VARYING_GAIN)
+          fill(gain[b] + k, gain[b] + k + runs[r].length,
+               runs[r].kind == SmoothingWindow::UNITY_GAIN ? 1.f : 0.f);
+        k += runs[r].length;
+      }
+    }
+    mix4(buf->push_frames(frames, n), gains, output + offset, n);
+  }
+};
+
+const unsigned MultibandNoiseGate::bands;
+
+void activate_multiband_noise_gate(LADSPA_Handle handle) {
+  static_cast<MultibandNoiseGate *>(handle)->activate();
+}
+
+void run_multiband_noise_gate(LADSPA_Handle handle, unsigned long n_samples) {
+  static_cast<MultibandNoiseGate *>(handle)->run(n_samples);
+}
+
+// The threshold, window size, non-silence and attack ports that every gate
+// starts with
+static void add_detector_ports(CMT_Descriptor *desc,
+                               LADSPA_PortDescriptor detector_control) {
   desc->addPort
-    (LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
+    (detector_control,
      "Threshold (dB)",
      LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE,
      -80, 0);
@@ -226,9 +1128,9 @@ void init_noise_gate() {
     (LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
      "Window size (ms)",
      LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE,
-     100, 3000);
+     min_window_ms, max_window_ms);
   desc->addPort
-    (LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
+    (detector_control,
      "Non-silent audio per window (ms)",
      LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE,
      10, 500);
@@ -236,7 +1138,122 @@ void init_noise_gate() {
     (LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
      "Attack/decay (ms)",
      LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE,
-     10, 200);
+     min_attack_ms, max_attack_ms);
+}
+
+static void add_curve_port(CMT_Descriptor *desc) {
+  desc->addPort
+    (LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
+     "Attack/decay curve (0 = exponential, 1 = linear, 2 = raised cosine, 3 = equal power)",
+     LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE |
+     LADSPA_HINT_INTEGER | LADSPA_HINT_DEFAULT_0,
+     0, 3);
+}
+
+// channel_names names the audio ports of a multichannel gate, one entry per
+// channel of config.
+static void register_noise_gate(unsigned long id,
+                                const char *label,
+                                const char *name,
+                                NoiseGateConfig *config,
+                                const vector<string> &channel_names = {}) {
+  CMT_Descriptor *desc = new CMT_Descriptor
+    (id,
+     label,
+     LADSPA_PROPERTY_HARD_RT_CAPABLE,
+     name,
+     "Roman Cheplyaka",
+     "(c) Roman Cheplyaka 2018",
+     config, // ImplementationData
+     CMT_Instantiate<NoiseGate>,
+     activate_noise_gate,
+     run_noise_gate,
+     nullptr, // run_adding
+     nullptr, // set_run_adding_gain
+     nullptr  // deactivate: the state is reset in activate
+     );
+  add_detector_ports(desc, LADSPA_PORT_INPUT |
+    (config->audio_rate_controls ? LADSPA_PORT_AUDIO : LADSPA_PORT_CONTROL));
+  if (config->channels == 1) {
+    desc->addPort
+      (LADSPA_PORT_INPUT | LADSPA_PORT_AUDIO,
+       "Input");
+    desc->addPort
+      (LADSPA_PORT_OUTPUT | LADSPA_PORT_AUDIO,
+       "Output");
+  } else {
+    for (unsigned c = 0; c < config->channels; c++)
+      desc->addPort
+        (LADSPA_PORT_INPUT | LADSPA_PORT_AUDIO,
+         ("Input (" + channel_names[c] + ")").c_str());
+    for (unsigned c = 0; c < config->channels; c++)
+      desc->addPort
+        (LADSPA_PORT_OUTPUT | LADSPA_PORT_AUDIO,
+         ("Output (" + channel_names[c] + ")").c_str());
+  }
+  desc->addPort
+    (LADSPA_PORT_OUTPUT | LADSPA_PORT_CONTROL,
+     "latency");
+  add_curve_port(desc);
+  desc->addPort
+    (LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
+     "Detector hop (samples)",
+     LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE |
+     LADSPA_HINT_INTEGER | LADSPA_HINT_DEFAULT_1,
+     1, max_hop);
+  desc->addPort
+    (LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
+     "Detector (0 = peak, 1 = RMS, 2 = peak follower)",
+     LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE |
+     LADSPA_HINT_INTEGER | LADSPA_HINT_DEFAULT_0,
+     0, 2);
+  if (config->key_input)
+    desc->addPort
+      (LADSPA_PORT_INPUT | LADSPA_PORT_AUDIO,
+       "Key input");
+  desc->addPort
+    (LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
+     "Detector high-pass (Hz, 0 = off)",
+     LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE |
+     LADSPA_HINT_DEFAULT_0,
+     0, 2000);
+  desc->addPort
+    (LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
+     "Detector low-pass (Hz, 0 = off)",
+     LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE |
+     LADSPA_HINT_DEFAULT_0,
+     0, 20000);
+  // How far past a sample the gate looks before deciding on it; it is at
+  // most half the window, which is also the default. Less lookahead means
+  // less latency, but the gate opens later.
+  desc->addPort
+    (LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
+     "Lookahead (ms)",
+     LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE |
+     LADSPA_HINT_DEFAULT_MAXIMUM,
+     0, max_window_ms / 2);
+  registerNewPluginDescriptor(desc);
+}
+
+static void register_multiband_noise_gate(unsigned long id,
+                                          const char *label,
+                                          const char *name) {
+  CMT_Descriptor *desc = new CMT_Descriptor
+    (id,
+     label,
+     LADSPA_PROPERTY_HARD_RT_CAPABLE,
+     name,
+     "Roman Cheplyaka",
+     "(c) Roman Cheplyaka 2018",
+     nullptr, // ImplementationData
+     CMT_Instantiate<MultibandNoiseGate>,
+     activate_multiband_noise_gate,
+     run_multiband_noise_gate,
+     nullptr, // run_adding
+     nullptr, // set_run_adding_gain
+     nullptr  // deactivate: the state is reset in activate
+     );
+  add_detector_ports(desc, LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL);
   desc->addPort
     (LADSPA_PORT_INPUT | LADSPA_PORT_AUDIO,
      "Input");
@@ -246,5 +1263,92 @@ void init_noise_gate() {
   desc->addPort
     (LADSPA_PORT_OUTPUT | LADSPA_PORT_CONTROL,
      "latency");
+  add_curve_port(desc);
+  desc->addPort
+    (LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
+     "Low crossover (Hz)",
+     LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE |
+     LADSPA_HINT_LOGARITHMIC | LADSPA_HINT_DEFAULT_MIDDLE,
+     40, 400);
+  desc->addPort
+    (LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
+     "Middle crossover (Hz)",
+     LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE |
+     LADSPA_HINT_LOGARITHMIC | LADSPA_HINT_DEFAULT_MIDDLE,
+     400, 4000);
+  desc->addPort
+    (LADSPA_PORT_INPUT | LADSPA_PORT_CONTROL,
+     "High crossover (Hz)",
+     LADSPA_HINT_BOUNDED_BELOW | LADSPA_HINT_BOUNDED_ABOVE |
+     LADSPA_HINT_LOGARITHMIC | LADSPA_HINT_DEFAULT_MIDDLE,
+     4000, 16000);
   registerNewPluginDescriptor(desc);
 }
+
+void init_noise_gate() {
+  register_noise_gate(5581, "noise_gate", "Roman's Noise Gate",
+                      new NoiseGateConfig(false));
+  // Stores only the positions where the signal crosses the threshold, which
+  // is cheaper for material with long silent and non-silent stretches.
+  register_noise_gate(5582, "noise_gate_transitions",
+                      "Roman's Noise Gate (transition window)",
+                      new NoiseGateConfig(true));
+  // All channels open and close together, so the stereo image stays put.
+  register_noise_gate(5583, "noise_gate_stereo",
+                      "Roman's Noise Gate (stereo)",
+                      new NoiseGateConfig(false, 2),
+                      {"left", "right"});
+  register_noise_gate(5584, "noise_gate_5_1",
+                      "Roman's Noise Gate (5.1)",
+                      new NoiseGateConfig(false, 6),
+                      {"front left", "front right", "center", "LFE",
+                       "surround left", "surround right"});
+  register_noise_gate(5585, "noise_gate_8ch",
+                      "Roman's Noise Gate (8 channels)",
+                      new NoiseGateConfig(false, 8),
+                      {"1", "2", "3", "4", "5", "6", "7", "8"});
+  // The threshold and the amount of non-silence can follow a modulation
+  // source sample by sample.
+  register_noise_gate(5586, "noise_gate_audio_rate",
+                      "Roman's Noise Gate (audio-rate threshold)",
+                      new NoiseGateConfig(false, 1, true));
+  // The gate opens and closes on a key signal, e.g. a clean reference
+  // microphone, rather than on the channels it gates; the key is only
+  // analysed, never output.
+  register_noise_gate(5587, "noise_gate_key",
+                      "Roman's Noise Gate (key input)",
+                      new NoiseGateConfig(false, 1, false, true));
+  register_noise_gate(5588, "noise_gate_stereo_key",
+                      "Roman's Noise Gate (stereo, key input)",
+                      new NoiseGateConfig(false, 2, false, true),
+                      {"left", "right"});
+  register_noise_gate(5589, "noise_gate_8ch_key",
+                      "Roman's Noise Gate (8 channels, key input)",
+                      new NoiseGateConfig(false, 8, false, true),
+                      {"1", "2", "3", "4", "5", "6", "7", "8"});
+  // Each of four bands opens and closes on its own, so that e.g. rumble
+  // between words is gated while the voice passes.
+  register_multiband_noise_gate(5590, "noise_gate_multiband",
+                                "Roman's Noise Gate (4 bands)");
+  // The latency buffer holds 16- or 24-bit samples rather than floats, for
+  // hosts running many instances: it takes a half or three quarters of the
+  // memory, at the cost of quantizing the output and clipping it at 0 dBFS.
+  register_noise_gate(5591, "noise_gate_16bit",
+                      "Roman's Noise Gate (16-bit latency buffer)",
+                      new NoiseGateConfig(false, 1, false, false,
+                                          STORE_16_BIT));
+  register_noise_gate(5592, "noise_gate_24bit",
+                      "Roman's Noise Gate (24-bit latency buffer)",
+                      new NoiseGateConfig(false, 1, false, false,
+                                          STORE_24_BIT));
+  register_noise_gate(5593, "noise_gate_stereo_16bit",
+                      "Roman's Noise Gate (stereo, 16-bit latency buffer)",
+                      new NoiseGateConfig(false, 2, false, false,
+                                          STORE_16_BIT),
+                      {"left", "right"});
+  register_noise_gate(5594, "noise_gate_stereo_24bit",
+                      "Roman's Noise Gate (stereo, 24-bit latency buffer)",
+                      new NoiseGateConfig(false, 2, false, false,
+                                          STORE_24_BIT),
+                      {"left", "right"});
+}
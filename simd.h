@@ -0,0 +1,965 @@
+// Small vectorized helpers used by the block kernels in ng.cpp.
+//
+// Every function has an SSE implementation and a portable fallback with
+// identical results.
+
+#ifndef NG_SIMD_INCLUDED
+#define NG_SIMD_INCLUDED
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// out[i] = |in[i]|
+inline void abs_block(const float *in, float *out, unsigned long n) {
+  unsigned long i = 0;
+#ifdef __SSE__
+  const __m128 sign = _mm_set1_ps(-0.f);
+  for (; i < (n & ~3ul); i += 4) {
+    _mm_storeu_ps(out + i, _mm_andnot_ps(sign, _mm_loadu_ps(in + i)));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = std::fabs(in[i]);
+  }
+}
+
+// out[i] = max(a[i], b[i])
+inline void max_block(const float *a, const float *b, float *out,
+                      unsigned long n) {
+  unsigned long i = 0;
+#ifdef __SSE__
+  for (; i < (n & ~3ul); i += 4) {
+    _mm_storeu_ps(out + i, _mm_max_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = a[i] > b[i] ? a[i] : b[i];
+  }
+}
+
+// out[i] = a[i] * b[i]
+inline void mul_block(const float *a, const float *b, float *out,
+                      unsigned long n) {
+  unsigned long i = 0;
+#ifdef __SSE__
+  for (; i < (n & ~3ul); i += 4) {
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = a[i] * b[i];
+  }
+}
+
+// out[i] = a[i] + b[i]
+inline void add_block(const float *a, const float *b, float *out,
+                      unsigned long n) {
+  unsigned long i = 0;
+#ifdef __SSE__
+  for (; i < (n & ~3ul); i += 4) {
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = a[i] + b[i];
+  }
+}
+
+// out[i] = s + a[0] + ... + a[i]; returns out[n - 1] (s if n == 0). Each group
+// of four is scanned within a register and then added to the running sum,
+// which keeps the dependency chain to one addition per four samples. The
+// fallback adds in the same order.
+inline float prefix_sum_block(const float *a, float *out, unsigned long n,
+                              float s) {
+  unsigned long i = 0;
+#ifdef __SSE2__
+  __m128 sv = _mm_set1_ps(s);
+  for (; i < (n & ~3ul); i += 4) {
+    __m128 x = _mm_loadu_ps(a + i);
+    x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 4)));
+    x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 8)));
+    x = _mm_add_ps(x, sv);
+    _mm_storeu_ps(out + i, x);
+    sv = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 3, 3));
+  }
+  if (i > 0)
+    s = out[i - 1];
+#else
+  for (; i < (n & ~3ul); i += 4) {
+    float t1 = a[i + 1] + a[i], t2 = a[i + 2] + a[i + 1],
+      t3 = a[i + 3] + a[i + 2];
+    out[i] = a[i] + s;
+    out[i + 1] = t1 + s;
+    out[i + 2] = (t2 + a[i]) + s;
+    out[i + 3] = (t3 + t1) + s;
+    s = out[i + 3];
+  }
+#endif
+  for (; i < n; i++) {
+    s += a[i];
+    out[i] = s;
+  }
+  return s;
+}
+
+// out[i] = max(|a[i]|, r * out[i - 1]), with out[-1] = e; returns out[n - 1]
+// (e if n == 0). This is a peak follower with instant attack and release
+// factor r. Each group of four is scanned within a register with the powers of
+// r, so the dependency chain is one multiplication and one maximum per four
+// samples; the fallback computes the same products in the same order.
+inline float follow_block(const float *a, float r, float *out, unsigned long n,
+                          float e) {
+  const float r2 = r * r, r3 = r2 * r, r4 = r2 * r2;
+  unsigned long i = 0;
+#ifdef __SSE2__
+  const __m128 sign = _mm_set1_ps(-0.f);
+  const __m128 rv = _mm_set1_ps(r), r2v = _mm_set1_ps(r2);
+  const __m128 powers = _mm_setr_ps(r, r2, r3, r4);
+  __m128 ev = _mm_set1_ps(e);
+  for (; i < (n & ~3ul); i += 4) {
+    __m128 x = _mm_andnot_ps(sign, _mm_loadu_ps(a + i));
+    __m128 y = _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 4));
+    x = _mm_max_ps(x, _mm_mul_ps(y, rv));
+    y = _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 8));
+    x = _mm_max_ps(x, _mm_mul_ps(y, r2v));
+    x = _mm_max_ps(x, _mm_mul_ps(ev, powers));
+    _mm_storeu_ps(out + i, x);
+    ev = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 3, 3));
+  }
+  if (i > 0)
+    e = out[i - 1];
+#else
+  for (; i < (n & ~3ul); i += 4) {
+    float x0 = std::fabs(a[i]), x1 = std::fabs(a[i + 1]),
+      x2 = std::fabs(a[i + 2]), x3 = std::fabs(a[i + 3]);
+    float y0 = x0, y1 = std::fmax(x1, x0 * r), y2 = std::fmax(x2, x1 * r),
+      y3 = std::fmax(x3, x2 * r);
+    float z2 = std::fmax(y2, y0 * r2), z3 = std::fmax(y3, y1 * r2);
+    out[i] = std::fmax(y0, e * r);
+    out[i + 1] = std::fmax(y1, e * r2);
+    out[i + 2] = std::fmax(z2, e * r3);
+    out[i + 3] = std::fmax(z3, e * r4);
+    e = out[i + 3];
+  }
+#endif
+  for (; i < n; i++) {
+    float x = std::fabs(a[i]), d = e * r;
+    e = x > d ? x : d;
+    out[i] = e;
+  }
+  return e;
+}
+
+// out[i] = sqrt(a[i] * s)
+inline void sqrt_scale_block(const float *a, float s, float *out,
+                             unsigned long n) {
+  unsigned long i = 0;
+#ifdef __SSE__
+  const __m128 sv = _mm_set1_ps(s);
+  for (; i < (n & ~3ul); i += 4) {
+    _mm_storeu_ps(out + i, _mm_sqrt_ps(_mm_mul_ps(_mm_loadu_ps(a + i), sv)));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = std::sqrt(a[i] * s);
+  }
+}
+
+// Set bit i of the packed bit array words to (a[i] >= t). Bits past n in the
+// last word are cleared.
+inline void pack_ge(const float *a, float t, uint64_t *words, unsigned long n) {
+  for (unsigned long w = 0; w * 64 < n; w++) {
+    const float *x = a + w * 64;
+    unsigned long m = n - w * 64 < 64 ? n - w * 64 : 64;
+    uint64_t bits = 0;
+    unsigned long i = 0;
+#ifdef __SSE__
+    const __m128 tv = _mm_set1_ps(t);
+    for (; i < (m & ~3ul); i += 4) {
+      uint64_t b = _mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(x + i), tv));
+      bits |= b << i;
+    }
+#endif
+    for (; i < m; i++) {
+      bits |= (uint64_t) (x[i] >= t) << i;
+    }
+    words[w] = bits;
+  }
+}
+
+// Set bit i of the packed bit array words to (|a[i]| >= t). Bits past n in the
+// last word are cleared.
+inline void pack_abs_ge(const float *a, float t, uint64_t *words,
+                        unsigned long n) {
+  for (unsigned long w = 0; w * 64 < n; w++) {
+    const float *x = a + w * 64;
+    unsigned long m = n - w * 64 < 64 ? n - w * 64 : 64;
+    uint64_t bits = 0;
+    unsigned long i = 0;
+#ifdef __SSE__
+    const __m128 tv = _mm_set1_ps(t), sign = _mm_set1_ps(-0.f);
+    for (; i < (m & ~3ul); i += 4) {
+      __m128 v = _mm_andnot_ps(sign, _mm_loadu_ps(x + i));
+      uint64_t b = _mm_movemask_ps(_mm_cmpge_ps(v, tv));
+      bits |= b << i;
+    }
+#endif
+    for (; i < m; i++) {
+      bits |= (uint64_t) (std::fabs(x[i]) >= t) << i;
+    }
+    words[w] = bits;
+  }
+}
+
+// Like pack_ge, but compare a[i] to the threshold t + dt * (i + 1)
+inline void pack_ge_ramp(const float *a, float t, float dt, uint64_t *words,
+                         unsigned long n) {
+  for (unsigned long w = 0; w * 64 < n; w++) {
+    const float *x = a + w * 64;
+    unsigned long m = n - w * 64 < 64 ? n - w * 64 : 64;
+    uint64_t bits = 0;
+    unsigned long i = 0;
+#ifdef __SSE__
+    const __m128 tv = _mm_set1_ps(t), dtv = _mm_set1_ps(dt);
+    const __m128 steps = _mm_setr_ps(1, 2, 3, 4);
+    for (; i < (m & ~3ul); i += 4) {
+      __m128 k = _mm_add_ps(_mm_set1_ps(w * 64 + i), steps);
+      __m128 th = _mm_add_ps(tv, _mm_mul_ps(dtv, k));
+      uint64_t b = _mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(x + i), th));
+      bits |= b << i;
+    }
+#endif
+    for (; i < m; i++) {
+      bits |= (uint64_t) (x[i] >= t + dt * (float) (w * 64 + i + 1)) << i;
+    }
+    words[w] = bits;
+  }
+}
+
+// Set bit i of the packed bit array words to (a[i] >= b[i]). Bits past n in
+// the last word are cleared.
+inline void pack_ge_block(const float *a, const float *b, uint64_t *words,
+                          unsigned long n) {
+  for (unsigned long w = 0; w * 64 < n; w++) {
+    const float *x = a + w * 64, *y = b + w * 64;
+    unsigned long m = n - w * 64 < 64 ? n - w * 64 : 64;
+    uint64_t bits = 0;
+    unsigned long i = 0;
+#ifdef __SSE__
+    for (; i < (m & ~3ul); i += 4) {
+      __m128 c = _mm_cmpge_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+      bits |= (uint64_t) _mm_movemask_ps(c) << i;
+    }
+#endif
+    for (; i < m; i++) {
+      bits |= (uint64_t) (x[i] >= y[i]) << i;
+    }
+    words[w] = bits;
+  }
+}
+
+// out[i] = 10^(db[i] / 20), i.e. decibels to a linear gain, with a relative
+// error below 1e-6 between -100 and 100 dB. The result is computed as 2^k * 2^f with an integer
+// k and |f| <= 1/2, the latter by its Taylor polynomial; the exponent is
+// clamped to the normal float range.
+inline void db_to_gain_block(const float *db, float *out, unsigned long n) {
+  const float log2_10_20 = 0.166096404744368f; // log2(10) / 20
+  const float c1 = 0.693147180559945f, c2 = 0.240226506959101f,
+    c3 = 0.0555041086648216f, c4 = 0.00961812910762848f,
+    c5 = 0.00133335581464284f, c6 = 0.000154035303933816f;
+  unsigned long i = 0;
+#ifdef __SSE2__
+  for (; i < (n & ~3ul); i += 4) {
+    __m128 x = _mm_mul_ps(_mm_loadu_ps(db + i), _mm_set1_ps(log2_10_20));
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-126.f)), _mm_set1_ps(126.f));
+    __m128i k = _mm_cvtps_epi32(x); // rounds to nearest
+    __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(k));
+    __m128 p = _mm_set1_ps(c6);
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c5));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c4));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c3));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c2));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(c1));
+    p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.f));
+    __m128i scale = _mm_slli_epi32(_mm_add_epi32(k, _mm_set1_epi32(127)), 23);
+    _mm_storeu_ps(out + i, _mm_mul_ps(p, _mm_castsi128_ps(scale)));
+  }
+#endif
+  for (; i < n; i++) {
+    float x = db[i] * log2_10_20;
+    x = x > -126.f ? x : -126.f;
+    x = x < 126.f ? x : 126.f;
+    int32_t k = (int32_t) std::nearbyint(x);
+    float f = x - (float) k;
+    float p = c6;
+    p = p * f + c5;
+    p = p * f + c4;
+    p = p * f + c3;
+    p = p * f + c2;
+    p = p * f + c1;
+    p = p * f + 1.f;
+    uint32_t bits = (uint32_t) (k + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof scale);
+    out[i] = p * scale;
+  }
+}
+
+// The largest |a[i]|, or 0 if n == 0
+inline float max_abs(const float *a, unsigned long n) {
+  unsigned long i = 0;
+  float m = 0;
+#ifdef __SSE__
+  const __m128 sign = _mm_set1_ps(-0.f);
+  __m128 mv = _mm_setzero_ps();
+  for (; i < (n & ~3ul); i += 4) {
+    mv = _mm_max_ps(mv, _mm_andnot_ps(sign, _mm_loadu_ps(a + i)));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, mv);
+  for (float x : lanes)
+    m = x > m ? x : m;
+#endif
+  for (; i < n; i++) {
+    float x = std::fabs(a[i]);
+    m = x > m ? x : m;
+  }
+  return m;
+}
+
+// The sum of a[i]^2. The fallback adds in the same order as the SSE version:
+// four interleaved partial sums, then the tail.
+inline float sum_squares(const float *a, unsigned long n) {
+  unsigned long i = 0;
+  float lanes[4] = {0, 0, 0, 0};
+#ifdef __SSE__
+  __m128 sv = _mm_setzero_ps();
+  for (; i < (n & ~3ul); i += 4) {
+    __m128 x = _mm_loadu_ps(a + i);
+    sv = _mm_add_ps(sv, _mm_mul_ps(x, x));
+  }
+  _mm_storeu_ps(lanes, sv);
+#else
+  for (; i < (n & ~3ul); i += 4) {
+    for (unsigned k = 0; k < 4; k++)
+      lanes[k] += a[i + k] * a[i + k];
+  }
+#endif
+  float s = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+  for (; i < n; i++) {
+    s += a[i] * a[i];
+  }
+  return s;
+}
+
+// out[i] = max(out[i], |a[i]|)
+inline void max_abs_block(const float *a, float *out, unsigned long n) {
+  unsigned long i = 0;
+#ifdef __SSE__
+  const __m128 sign = _mm_set1_ps(-0.f);
+  for (; i < (n & ~3ul); i += 4) {
+    __m128 x = _mm_andnot_ps(sign, _mm_loadu_ps(a + i));
+    _mm_storeu_ps(out + i, _mm_max_ps(x, _mm_loadu_ps(out + i)));
+  }
+#endif
+  for (; i < n; i++) {
+    float x = std::fabs(a[i]);
+    out[i] = x > out[i] ? x : out[i];
+  }
+}
+
+// The coefficients of a biquad section for each of four lanes, normalized so
+// that a0 == 1
+struct Biquad4 {
+  float b0[4], b1[4], b2[4], a1[4], a2[4];
+};
+
+// The most sections biquad_lanes_block() takes
+const unsigned max_lane_biquads = 8;
+
+// Feed in[i] to all four lanes of a cascade of n_stages biquads in transposed
+// direct form II, with separate coefficients in each lane, and store the
+// four outputs for sample i in out[4 * i .. 4 * i + 4). state holds the two
+// state variables of each section, for the four lanes: s1 then s2.
+inline void biquad_lanes_block(const Biquad4 *stages, unsigned n_stages,
+                               float *state, const float *in, float *out,
+                               unsigned long n) {
+#ifdef __SSE__
+  __m128 b0[max_lane_biquads], b1[max_lane_biquads], b2[max_lane_biquads],
+    a1[max_lane_biquads], a2[max_lane_biquads], s1[max_lane_biquads],
+    s2[max_lane_biquads];
+  for (unsigned k = 0; k < n_stages; k++) {
+    b0[k] = _mm_loadu_ps(stages[k].b0);
+    b1[k] = _mm_loadu_ps(stages[k].b1);
+    b2[k] = _mm_loadu_ps(stages[k].b2);
+    a1[k] = _mm_loadu_ps(stages[k].a1);
+    a2[k] = _mm_loadu_ps(stages[k].a2);
+    s1[k] = _mm_loadu_ps(state + 8 * k);
+    s2[k] = _mm_loadu_ps(state + 8 * k + 4);
+  }
+  for (unsigned long i = 0; i < n; i++) {
+    __m128 x = _mm_set1_ps(in[i]);
+    for (unsigned k = 0; k < n_stages; k++) {
+      __m128 y = _mm_add_ps(_mm_mul_ps(b0[k], x), s1[k]);
+      s1[k] = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1[k], x), _mm_mul_ps(a1[k], y)),
+                         s2[k]);
+      s2[k] = _mm_sub_ps(_mm_mul_ps(b2[k], x), _mm_mul_ps(a2[k], y));
+      x = y;
+    }
+    _mm_storeu_ps(out + 4 * i, x);
+  }
+  for (unsigned k = 0; k < n_stages; k++) {
+    _mm_storeu_ps(state + 8 * k, s1[k]);
+    _mm_storeu_ps(state + 8 * k + 4, s2[k]);
+  }
+#else
+  for (unsigned long i = 0; i < n; i++) {
+    for (unsigned c = 0; c < 4; c++) {
+      float x = in[i];
+      for (unsigned k = 0; k < n_stages; k++) {
+        const Biquad4 &b = stages[k];
+        float &s1 = state[8 * k + c], &s2 = state[8 * k + 4 + c];
+        float y = b.b0[c] * x + s1;
+        s1 = (b.b1[c] * x - b.a1[c] * y) + s2;
+        s2 = b.b2[c] * x - b.a2[c] * y;
+        x = y;
+      }
+      out[4 * i + c] = x;
+    }
+  }
+#endif
+}
+
+// out[i] = sum over c < 4 of frames[4 * i + c] * gain[c][i]
+inline void mix4(const float *frames, const float *const *gain, float *out,
+                 unsigned long n) {
+  unsigned long i = 0;
+#ifdef __SSE__
+  for (; i < (n & ~3ul); i += 4) {
+    __m128 r0 = _mm_loadu_ps(frames + 4 * i),
+      r1 = _mm_loadu_ps(frames + 4 * i + 4),
+      r2 = _mm_loadu_ps(frames + 4 * i + 8),
+      r3 = _mm_loadu_ps(frames + 4 * i + 12);
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    __m128 y = _mm_mul_ps(r0, _mm_loadu_ps(gain[0] + i));
+    y = _mm_add_ps(y, _mm_mul_ps(r1, _mm_loadu_ps(gain[1] + i)));
+    y = _mm_add_ps(y, _mm_mul_ps(r2, _mm_loadu_ps(gain[2] + i)));
+    y = _mm_add_ps(y, _mm_mul_ps(r3, _mm_loadu_ps(gain[3] + i)));
+    _mm_storeu_ps(out + i, y);
+  }
+#endif
+  for (; i < n; i++) {
+    const float *f = frames + 4 * i;
+    out[i] = ((f[0] * gain[0][i] + f[1] * gain[1][i]) + f[2] * gain[2][i]) +
+      f[3] * gain[3][i];
+  }
+}
+
+// The running maximum of each lane of frames of four: m[c] = max(m[c],
+// a[4 * i + c]) and out[4 * i + c] = m[c], for i from 0 to n - 1
+inline void prefix_max4_block(const float *a, float *m, float *out,
+                              unsigned long n) {
+#ifdef __SSE__
+  __m128 v = _mm_loadu_ps(m);
+  for (unsigned long i = 0; i < n; i++) {
+    v = _mm_max_ps(v, _mm_loadu_ps(a + 4 * i));
+    _mm_storeu_ps(out + 4 * i, v);
+  }
+  _mm_storeu_ps(m, v);
+#else
+  for (unsigned long i = 0; i < n; i++) {
+    for (unsigned c = 0; c < 4; c++) {
+      float x = a[4 * i + c];
+      m[c] = m[c] < x ? x : m[c];
+      out[4 * i + c] = m[c];
+    }
+  }
+#endif
+}
+
+// out[4 * i + c] = max(a[4 * i + c], out[4 * (i + 1) + c]) for i from n - 1
+// down to 0, i.e. the maximum of each lane from frame i on, starting from
+// the frame in out[4 * n .. 4 * n + 4)
+inline void suffix_max4_block(const float *a, float *out, unsigned long n) {
+#ifdef __SSE__
+  __m128 v = _mm_loadu_ps(out + 4 * n);
+  for (unsigned long i = n; i-- > 0; ) {
+    v = _mm_max_ps(v, _mm_loadu_ps(a + 4 * i));
+    _mm_storeu_ps(out + 4 * i, v);
+  }
+#else
+  for (unsigned long i = n; i-- > 0; ) {
+    for (unsigned c = 0; c < 4; c++) {
+      float x = a[4 * i + c], m = out[4 * (i + 1) + c];
+      out[4 * i + c] = m < x ? x : m;
+    }
+  }
+#endif
+}
+
+// pack_ge_ramp() on each lane of frames of four: set bit i of words[c] to
+// (frames[4 * i + c] >= t + dt * (i + 1)). Bits past n in the last words
+// are cleared.
+inline void pack_ge_ramp4(const float *frames, float t, float dt,
+                          uint64_t *const *words, unsigned long n) {
+  for (unsigned long w = 0; w * 64 < n; w++) {
+    const float *x = frames + 4 * w * 64;
+    unsigned long m = n - w * 64 < 64 ? n - w * 64 : 64;
+    uint64_t bits[4] = {};
+    unsigned long i = 0;
+#ifdef __SSE__
+    const __m128 tv = _mm_set1_ps(t), dtv = _mm_set1_ps(dt);
+    const __m128 steps = _mm_setr_ps(1, 2, 3, 4);
+    for (; i < (m & ~3ul); i += 4) {
+      __m128 k = _mm_add_ps(_mm_set1_ps(w * 64 + i), steps);
+      __m128 th = _mm_add_ps(tv, _mm_mul_ps(dtv, k));
+      __m128 r0 = _mm_loadu_ps(x + 4 * i), r1 = _mm_loadu_ps(x + 4 * i + 4),
+        r2 = _mm_loadu_ps(x + 4 * i + 8), r3 = _mm_loadu_ps(x + 4 * i + 12);
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      bits[0] |= (uint64_t) _mm_movemask_ps(_mm_cmpge_ps(r0, th)) << i;
+      bits[1] |= (uint64_t) _mm_movemask_ps(_mm_cmpge_ps(r1, th)) << i;
+      bits[2] |= (uint64_t) _mm_movemask_ps(_mm_cmpge_ps(r2, th)) << i;
+      bits[3] |= (uint64_t) _mm_movemask_ps(_mm_cmpge_ps(r3, th)) << i;
+    }
+#endif
+    for (; i < m; i++) {
+      float th = t + dt * (float) (w * 64 + i + 1);
+      for (unsigned c = 0; c < 4; c++)
+        bits[c] |= (uint64_t) (x[4 * i + c] >= th) << i;
+    }
+    for (unsigned c = 0; c < 4; c++)
+      words[c][w] = bits[c];
+  }
+}
+
+// out[i * channels + c] = in[c][offset + i]
+inline void interleave(const float *const *in, unsigned long offset,
+                       unsigned channels, float *out, unsigned long n) {
+  if (channels == 1) {
+    std::memcpy(out, in[0] + offset, n * sizeof(float));
+    return;
+  }
+  unsigned long i = 0;
+#ifdef __SSE__
+  if (channels == 2) {
+    const float *l = in[0] + offset, *r = in[1] + offset;
+    for (; i < (n & ~3ul); i += 4) {
+      __m128 a = _mm_loadu_ps(l + i), b = _mm_loadu_ps(r + i);
+      _mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(a, b));
+      _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(a, b));
+    }
+  } else if (channels == 4) {
+    for (; i < (n & ~3ul); i += 4) {
+      __m128 r0 = _mm_loadu_ps(in[0] + offset + i),
+        r1 = _mm_loadu_ps(in[1] + offset + i),
+        r2 = _mm_loadu_ps(in[2] + offset + i),
+        r3 = _mm_loadu_ps(in[3] + offset + i);
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      _mm_storeu_ps(out + 4 * i, r0);
+      _mm_storeu_ps(out + 4 * i + 4, r1);
+      _mm_storeu_ps(out + 4 * i + 8, r2);
+      _mm_storeu_ps(out + 4 * i + 12, r3);
+    }
+  } else if (channels == 6) {
+    // Channels 0-3 of four frames take a 4x4 transpose; channels 4 and 5
+    // are paired up and fill the gaps between them.
+    for (; i < (n & ~3ul); i += 4) {
+      __m128 r0 = _mm_loadu_ps(in[0] + offset + i),
+        r1 = _mm_loadu_ps(in[1] + offset + i),
+        r2 = _mm_loadu_ps(in[2] + offset + i),
+        r3 = _mm_loadu_ps(in[3] + offset + i);
+      __m128 a = _mm_loadu_ps(in[4] + offset + i),
+        b = _mm_loadu_ps(in[5] + offset + i);
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      __m128 ab_lo = _mm_unpacklo_ps(a, b), ab_hi = _mm_unpackhi_ps(a, b);
+      float *o = out + 6 * i;
+      _mm_storeu_ps(o, r0);
+      _mm_storeu_ps(o + 4, _mm_movelh_ps(ab_lo, r1));
+      _mm_storeu_ps(o + 8, _mm_shuffle_ps(r1, ab_lo, _MM_SHUFFLE(3, 2, 3, 2)));
+      _mm_storeu_ps(o + 12, r2);
+      _mm_storeu_ps(o + 16, _mm_movelh_ps(ab_hi, r3));
+      _mm_storeu_ps(o + 20, _mm_shuffle_ps(r3, ab_hi, _MM_SHUFFLE(3, 2, 3, 2)));
+    }
+  } else if (channels == 8) {
+    // Two 4x4 transposes, one for each half of the frames
+    for (; i < (n & ~3ul); i += 4) {
+      __m128 r0 = _mm_loadu_ps(in[0] + offset + i),
+        r1 = _mm_loadu_ps(in[1] + offset + i),
+        r2 = _mm_loadu_ps(in[2] + offset + i),
+        r3 = _mm_loadu_ps(in[3] + offset + i);
+      __m128 s0 = _mm_loadu_ps(in[4] + offset + i),
+        s1 = _mm_loadu_ps(in[5] + offset + i),
+        s2 = _mm_loadu_ps(in[6] + offset + i),
+        s3 = _mm_loadu_ps(in[7] + offset + i);
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      _MM_TRANSPOSE4_PS(s0, s1, s2, s3);
+      float *o = out + 8 * i;
+      _mm_storeu_ps(o, r0);
+      _mm_storeu_ps(o + 4, s0);
+      _mm_storeu_ps(o + 8, r1);
+      _mm_storeu_ps(o + 12, s1);
+      _mm_storeu_ps(o + 16, r2);
+      _mm_storeu_ps(o + 20, s2);
+      _mm_storeu_ps(o + 24, r3);
+      _mm_storeu_ps(o + 28, s3);
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    for (unsigned c = 0; c < channels; c++)
+      out[i * channels + c] = in[c][offset + i];
+  }
+}
+
+// The coefficients of a biquad section, normalized so that a0 == 1
+struct Biquad {
+  float b0, b1, b2, a1, a2;
+};
+
+// The most sections biquad_peak_block() takes
+const unsigned max_biquads = 4;
+
+// Run up to four channels in[0..channels) through a cascade of n_stages
+// biquads in transposed direct form II, and store the largest |y| across the
+// channels in out[i] (or in out[i] if it is larger, if accumulate). Each
+// channel takes a lane; unused lanes repeat channel 0, except that a single
+// channel runs its sections in the lanes instead. state holds the two
+// state variables of each section, for the four lanes: s1 then s2.
+inline void biquad_peak_block(const Biquad *stages, unsigned n_stages,
+                              float *state, const float *const *in,
+                              unsigned channels, float *out, unsigned long n,
+                              bool accumulate) {
+  if (channels == 1) {
+    // A single channel has nothing to fill the lanes with, so the sections
+    // take them instead: lane k runs section k, one sample behind lane k - 1,
+    // and the lanes past n_stages pass their input through. The state of
+    // the channel is in lane 0; the other lanes get a copy, as they would
+    // by repeating the channel.
+    float s1[max_biquads], s2[max_biquads];
+    for (unsigned k = 0; k < n_stages; k++) {
+      s1[k] = state[8 * k];
+      s2[k] = state[8 * k + 4];
+    }
+#ifdef __SSE__
+    float c[5][4] = {{1, 1, 1, 1}}, z1[4] = {}, z2[4] = {};
+    for (unsigned k = 0; k < n_stages; k++) {
+      c[0][k] = stages[k].b0;
+      c[1][k] = stages[k].b1;
+      c[2][k] = stages[k].b2;
+      c[3][k] = stages[k].a1;
+      c[4][k] = stages[k].a2;
+      z1[k] = s1[k];
+      z2[k] = s2[k];
+    }
+    const __m128 b0 = _mm_loadu_ps(c[0]), b1 = _mm_loadu_ps(c[1]),
+      b2 = _mm_loadu_ps(c[2]), a1 = _mm_loadu_ps(c[3]), a2 = _mm_loadu_ps(c[4]);
+    const __m128 lanes = _mm_setr_ps(0, 1, 2, 3), sign = _mm_set1_ps(-0.f);
+    __m128 v1 = _mm_loadu_ps(z1), v2 = _mm_loadu_ps(z2), y = _mm_setzero_ps();
+    // At step t lane k takes sample t - k, and lane 3 finishes sample t - 3.
+    // Only the first and last three steps have lanes out of the block.
+    for (unsigned long t = 0; t < n + 3; t++) {
+      __m128 x = _mm_move_ss(_mm_shuffle_ps(y, y, _MM_SHUFFLE(2, 1, 0, 0)),
+                             _mm_set_ss(t < n ? in[0][t] : 0));
+      y = _mm_add_ps(_mm_mul_ps(b0, x), v1);
+      __m128 n1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)),
+                             v2);
+      __m128 n2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+      if (t >= 3 && t < n) {
+        v1 = n1;
+        v2 = n2;
+      } else {
+        __m128 active = _mm_and_ps(
+          _mm_cmple_ps(lanes, _mm_set1_ps((float) t)),
+          _mm_cmpgt_ps(lanes, _mm_set1_ps((float) t - (float) n)));
+        v1 = _mm_or_ps(_mm_and_ps(active, n1), _mm_andnot_ps(active, v1));
+        v2 = _mm_or_ps(_mm_and_ps(active, n2), _mm_andnot_ps(active, v2));
+      }
+      if (t >= 3) {
+        float m = _mm_cvtss_f32(_mm_andnot_ps(
+          sign, _mm_shuffle_ps(y, y, _MM_SHUFFLE(3, 3, 3, 3))));
+        out[t - 3] = accumulate && out[t - 3] > m ? out[t - 3] : m;
+      }
+    }
+    _mm_storeu_ps(z1, v1);
+    _mm_storeu_ps(z2, v2);
+    for (unsigned k = 0; k < n_stages; k++) {
+      s1[k] = z1[k];
+      s2[k] = z2[k];
+    }
+#else
+    for (unsigned long i = 0; i < n; i++) {
+      float x = in[0][i];
+      for (unsigned k = 0; k < n_stages; k++) {
+        const Biquad &b = stages[k];
+        float y = b.b0 * x + s1[k];
+        s1[k] = (b.b1 * x - b.a1 * y) + s2[k];
+        s2[k] = b.b2 * x - b.a2 * y;
+        x = y;
+      }
+      float m = std::fabs(x);
+      out[i] = accumulate && out[i] > m ? out[i] : m;
+    }
+#endif
+    for (unsigned k = 0; k < n_stages; k++) {
+      for (unsigned c = 0; c < 4; c++) {
+        state[8 * k + c] = s1[k];
+        state[8 * k + 4 + c] = s2[k];
+      }
+    }
+    return;
+  }
+  const float *p[4];
+  for (unsigned c = 0; c < 4; c++)
+    p[c] = in[c < channels ? c : 0];
+#ifdef __SSE__
+  __m128 b0[max_biquads], b1[max_biquads], b2[max_biquads],
+    a1[max_biquads], a2[max_biquads], s1[max_biquads], s2[max_biquads];
+  for (unsigned k = 0; k < n_stages; k++) {
+    b0[k] = _mm_set1_ps(stages[k].b0);
+    b1[k] = _mm_set1_ps(stages[k].b1);
+    b2[k] = _mm_set1_ps(stages[k].b2);
+    a1[k] = _mm_set1_ps(stages[k].a1);
+    a2[k] = _mm_set1_ps(stages[k].a2);
+    s1[k] = _mm_loadu_ps(state + 8 * k);
+    s2[k] = _mm_loadu_ps(state + 8 * k + 4);
+  }
+  const __m128 sign = _mm_set1_ps(-0.f);
+  for (unsigned long i = 0; i < n; i++) {
+    __m128 x = _mm_setr_ps(p[0][i], p[1][i], p[2][i], p[3][i]);
+    for (unsigned k = 0; k < n_stages; k++) {
+      __m128 y = _mm_add_ps(_mm_mul_ps(b0[k], x), s1[k]);
+      s1[k] = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1[k], x), _mm_mul_ps(a1[k], y)),
+                         s2[k]);
+      s2[k] = _mm_sub_ps(_mm_mul_ps(b2[k], x), _mm_mul_ps(a2[k], y));
+      x = y;
+    }
+    x = _mm_andnot_ps(sign, x);
+    x = _mm_max_ps(x, _mm_shuffle_ps(x, x, _MM_SHUFFLE(1, 0, 3, 2)));
+    x = _mm_max_ps(x, _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 3, 0, 1)));
+    float m = _mm_cvtss_f32(x);
+    out[i] = accumulate && out[i] > m ? out[i] : m;
+  }
+  for (unsigned k = 0; k < n_stages; k++) {
+    _mm_storeu_ps(state + 8 * k, s1[k]);
+    _mm_storeu_ps(state + 8 * k + 4, s2[k]);
+  }
+#else
+  for (unsigned long i = 0; i < n; i++) {
+    float m = 0;
+    for (unsigned c = 0; c < 4; c++) {
+      float x = p[c][i];
+      for (unsigned k = 0; k < n_stages; k++) {
+        const Biquad &b = stages[k];
+        float &s1 = state[8 * k + c], &s2 = state[8 * k + 4 + c];
+        float y = b.b0 * x + s1;
+        s1 = (b.b1 * x - b.a1 * y) + s2;
+        s2 = b.b2 * x - b.a2 * y;
+        x = y;
+      }
+      x = std::fabs(x);
+      m = x > m ? x : m;
+    }
+    out[i] = accumulate && out[i] > m ? out[i] : m;
+  }
+#endif
+}
+
+// out[c][i] = in[i * channels + c], times gain[i] unless gain is null
+inline void deinterleave(const float *in, unsigned channels, const float *gain,
+                         float *const *out, unsigned long n) {
+  if (channels == 1) {
+    if (gain)
+      mul_block(in, gain, out[0], n);
+    else
+      std::memcpy(out[0], in, n * sizeof(float));
+    return;
+  }
+  unsigned long i = 0;
+#ifdef __SSE__
+  if (channels == 2) {
+    const __m128 one = _mm_set1_ps(1.f);
+    for (; i < (n & ~3ul); i += 4) {
+      __m128 a = _mm_loadu_ps(in + 2 * i), b = _mm_loadu_ps(in + 2 * i + 4);
+      __m128 g = gain ? _mm_loadu_ps(gain + i) : one;
+      __m128 l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+      __m128 r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+      _mm_storeu_ps(out[0] + i, _mm_mul_ps(l, g));
+      _mm_storeu_ps(out[1] + i, _mm_mul_ps(r, g));
+    }
+  } else if (channels == 4) {
+    const __m128 one = _mm_set1_ps(1.f);
+    for (; i < (n & ~3ul); i += 4) {
+      __m128 r0 = _mm_loadu_ps(in + 4 * i), r1 = _mm_loadu_ps(in + 4 * i + 4),
+        r2 = _mm_loadu_ps(in + 4 * i + 8), r3 = _mm_loadu_ps(in + 4 * i + 12);
+      __m128 g = gain ? _mm_loadu_ps(gain + i) : one;
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      _mm_storeu_ps(out[0] + i, _mm_mul_ps(r0, g));
+      _mm_storeu_ps(out[1] + i, _mm_mul_ps(r1, g));
+      _mm_storeu_ps(out[2] + i, _mm_mul_ps(r2, g));
+      _mm_storeu_ps(out[3] + i, _mm_mul_ps(r3, g));
+    }
+  } else if (channels == 6) {
+    // The inverse of the shuffles in interleave()
+    const __m128 one = _mm_set1_ps(1.f);
+    for (; i < (n & ~3ul); i += 4) {
+      const float *f = in + 6 * i;
+      __m128 v0 = _mm_loadu_ps(f), v1 = _mm_loadu_ps(f + 4),
+        v2 = _mm_loadu_ps(f + 8), v3 = _mm_loadu_ps(f + 12),
+        v4 = _mm_loadu_ps(f + 16), v5 = _mm_loadu_ps(f + 20);
+      __m128 g = gain ? _mm_loadu_ps(gain + i) : one;
+      __m128 r0 = v0, r1 = _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(1, 0, 3, 2)),
+        r2 = v3, r3 = _mm_shuffle_ps(v4, v5, _MM_SHUFFLE(1, 0, 3, 2));
+      __m128 ab_lo = _mm_shuffle_ps(v1, v2, _MM_SHUFFLE(3, 2, 1, 0)),
+        ab_hi = _mm_shuffle_ps(v4, v5, _MM_SHUFFLE(3, 2, 1, 0));
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      _mm_storeu_ps(out[0] + i, _mm_mul_ps(r0, g));
+      _mm_storeu_ps(out[1] + i, _mm_mul_ps(r1, g));
+      _mm_storeu_ps(out[2] + i, _mm_mul_ps(r2, g));
+      _mm_storeu_ps(out[3] + i, _mm_mul_ps(r3, g));
+      _mm_storeu_ps(out[4] + i, _mm_mul_ps(
+        _mm_shuffle_ps(ab_lo, ab_hi, _MM_SHUFFLE(2, 0, 2, 0)), g));
+      _mm_storeu_ps(out[5] + i, _mm_mul_ps(
+        _mm_shuffle_ps(ab_lo, ab_hi, _MM_SHUFFLE(3, 1, 3, 1)), g));
+    }
+  } else if (channels == 8) {
+    const __m128 one = _mm_set1_ps(1.f);
+    for (; i < (n & ~3ul); i += 4) {
+      const float *f = in + 8 * i;
+      __m128 r0 = _mm_loadu_ps(f), s0 = _mm_loadu_ps(f + 4),
+        r1 = _mm_loadu_ps(f + 8), s1 = _mm_loadu_ps(f + 12),
+        r2 = _mm_loadu_ps(f + 16), s2 = _mm_loadu_ps(f + 20),
+        r3 = _mm_loadu_ps(f + 24), s3 = _mm_loadu_ps(f + 28);
+      __m128 g = gain ? _mm_loadu_ps(gain + i) : one;
+      _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+      _MM_TRANSPOSE4_PS(s0, s1, s2, s3);
+      _mm_storeu_ps(out[0] + i, _mm_mul_ps(r0, g));
+      _mm_storeu_ps(out[1] + i, _mm_mul_ps(r1, g));
+      _mm_storeu_ps(out[2] + i, _mm_mul_ps(r2, g));
+      _mm_storeu_ps(out[3] + i, _mm_mul_ps(r3, g));
+      _mm_storeu_ps(out[4] + i, _mm_mul_ps(s0, g));
+      _mm_storeu_ps(out[5] + i, _mm_mul_ps(s1, g));
+      _mm_storeu_ps(out[6] + i, _mm_mul_ps(s2, g));
+      _mm_storeu_ps(out[7] + i, _mm_mul_ps(s3, g));
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    float g = gain ? gain[i] : 1.f;
+    for (unsigned c = 0; c < channels; c++)
+      out[c][i] = in[i * channels + c] * g;
+  }
+}
+
+
+// Signed fixed point with full scale 1.0, for storing float samples
+// compactly: the samples are scaled by 2^15 (pack_s16) or 2^23 (pack_s24),
+// clipped to the integer range and rounded to nearest. pack_s24 stores three
+// bytes per sample, least significant first. Unpacking is exact.
+inline void pack_s16(const float *in, int16_t *out, unsigned long n) {
+  unsigned long i = 0;
+#ifdef __SSE2__
+  const __m128 scale = _mm_set1_ps(32768.f), lo = _mm_set1_ps(-32768.f),
+    hi = _mm_set1_ps(32767.f);
+  for (; i < (n & ~7ul); i += 8) {
+    __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+    __m128 b = _mm_mul_ps(_mm_loadu_ps(in + i + 4), scale);
+    a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+    b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+    _mm_storeu_si128((__m128i *) (out + i),
+                     _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+  }
+#endif
+  for (; i < n; i++) {
+    float x = in[i] * 32768.f;
+    x = x > -32768.f ? x : -32768.f;
+    x = x < 32767.f ? x : 32767.f;
+    out[i] = (int16_t) lrintf(x);
+  }
+}
+
+inline void unpack_s16(const int16_t *in, float *out, unsigned long n) {
+  unsigned long i = 0;
+#ifdef __SSE2__
+  const __m128 scale = _mm_set1_ps(1.f / 32768);
+  for (; i < (n & ~7ul); i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *) (in + i));
+    __m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(a), scale));
+    _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(b), scale));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = in[i] * (1.f / 32768);
+  }
+}
+
+// The SSE2 versions move each group of four samples as two overlapping
+// 8-byte halves of 6 bytes each, which write (or read) the first two bytes of
+// the next sample too; so a group must not be the last.
+inline void pack_s24(const float *in, uint8_t *out, unsigned long n) {
+  unsigned long i = 0;
+#ifdef __SSE2__
+  const __m128 scale = _mm_set1_ps(8388608.f), lo = _mm_set1_ps(-8388608.f),
+    hi = _mm_set1_ps(8388607.f);
+  const __m128i even = _mm_setr_epi32(0xffffff, 0, 0xffffff, 0),
+    odd = _mm_setr_epi32(0, 0xffffff, 0, 0xffffff);
+  for (; i + 4 < n; i += 4) {
+    __m128 a = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+    __m128i v = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(a, lo), hi));
+    // each 64-bit lane holds two samples in its low 48 bits
+    v = _mm_or_si128(_mm_and_si128(v, even),
+                     _mm_srli_epi64(_mm_and_si128(v, odd), 8));
+    uint8_t *p = out + 3 * i;
+    _mm_storel_epi64((__m128i *) p, v);
+    _mm_storel_epi64((__m128i *) (p + 6), _mm_unpackhi_epi64(v, v));
+  }
+#endif
+  for (; i < n; i++) {
+    float x = in[i] * 8388608.f;
+    x = x > -8388608.f ? x : -8388608.f;
+    x = x < 8388607.f ? x : 8388607.f;
+    int32_t v = lrintf(x);
+    uint8_t *p = out + 3 * i;
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+  }
+}
+
+inline void unpack_s24(const uint8_t *in, float *out, unsigned long n) {
+  unsigned long i = 0;
+#ifdef __SSE2__
+  const __m128 scale = _mm_set1_ps(1.f / 8388608);
+  const __m128i even = _mm_setr_epi32(-1, 0, -1, 0),
+    odd = _mm_setr_epi32(0, -1, 0, -1);
+  for (; i + 4 < n; i += 4) {
+    const uint8_t *p = in + 3 * i;
+    __m128i v = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *) p),
+                                   _mm_loadl_epi64((const __m128i *) (p + 6)));
+    // move each sample to the top of its 32 bits, then shift it back down
+    // extending the sign
+    v = _mm_or_si128(_mm_and_si128(_mm_slli_epi64(v, 8), even),
+                     _mm_and_si128(_mm_slli_epi64(v, 16), odd));
+    v = _mm_srai_epi32(v, 8);
+    _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(v), scale));
+  }
+#endif
+  for (; i < n; i++) {
+    const uint8_t *p = in + 3 * i;
+    // the top byte goes into bits 24..31, so that the shift sign-extends
+    int32_t v = (int32_t) ((uint32_t) p[0] << 8 | (uint32_t) p[1] << 16 |
+                           (uint32_t) p[2] << 24) >> 8;
+    out[i] = v * (1.f / 8388608);
+  }
+}
+
+#endif
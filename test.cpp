@@ -0,0 +1,383 @@
+// Checks of the plugins and the gate engine, run with `make check`. Most
+// checks run plugins through the LADSPA interface on a synthetic signal and
+// compare their outputs.
+
+#include <ladspa.h>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "gate.h"
+
+using namespace std;
+
+static int failures = 0;
+
+static void check(bool ok, const string &what) {
+  printf("%s: %s\n", ok ? "ok" : "FAILED", what.c_str());
+  if (!ok)
+    failures++;
+}
+
+static const LADSPA_Descriptor *find_descriptor(unsigned long id) {
+  for (unsigned long i = 0; ladspa_descriptor(i); i++) {
+    if (ladspa_descriptor(i)->UniqueID == id)
+      return ladspa_descriptor(i);
+  }
+  return nullptr;
+}
+
+// The default of a control port, or its lower bound if it has none
+static LADSPA_Data default_value(const LADSPA_PortRangeHint &hint) {
+  switch (hint.HintDescriptor & LADSPA_HINT_DEFAULT_MASK) {
+  case LADSPA_HINT_DEFAULT_MAXIMUM:
+    return hint.UpperBound;
+  case LADSPA_HINT_DEFAULT_MIDDLE:
+    return (hint.LowerBound + hint.UpperBound) / 2;
+  case LADSPA_HINT_DEFAULT_0:
+    return 0;
+  case LADSPA_HINT_DEFAULT_1:
+    return 1;
+  default:
+    return hint.LowerBound;
+  }
+}
+
+// Run the mono plugin with the given ID over input in blocks of block_size,
+// with the control ports named in controls set to their values and the others
+// at their defaults, and return its output
+static vector<LADSPA_Data> run_plugin(unsigned long id,
+                                      const vector<LADSPA_Data> &input,
+                                      const map<string, LADSPA_Data> &controls,
+                                      unsigned long sample_rate = 48000,
+                                      unsigned long block_size = 1000) {
+  const LADSPA_Descriptor *desc = find_descriptor(id);
+  vector<LADSPA_Data> output(input.size());
+  vector<LADSPA_Data> values(desc->PortCount);
+  LADSPA_Handle instance = desc->instantiate(desc, sample_rate);
+  for (unsigned long p = 0; p < desc->PortCount; p++) {
+    if (!LADSPA_IS_PORT_CONTROL(desc->PortDescriptors[p]))
+      continue;
+    auto it = controls.find(desc->PortNames[p]);
+    values[p] = it != controls.end() ?
+      it->second : default_value(desc->PortRangeHints[p]);
+    desc->connect_port(instance, p, &values[p]);
+  }
+  desc->activate(instance);
+  for (unsigned long start = 0; start < input.size(); start += block_size) {
+    unsigned long n = min(block_size, input.size() - start);
+    for (unsigned long p = 0; p < desc->PortCount; p++) {
+      if (!LADSPA_IS_PORT_AUDIO(desc->PortDescriptors[p]))
+        continue;
+      desc->connect_port(instance, p, LADSPA_IS_PORT_INPUT(desc->PortDescriptors[p]) ?
+                         const_cast<LADSPA_Data *>(input.data()) + start :
+                         output.data() + start);
+    }
+    desc->run(instance, n);
+  }
+  desc->cleanup(instance);
+  return output;
+}
+
+static unsigned long count_differences(const vector<LADSPA_Data> &a,
+                                       const vector<LADSPA_Data> &b) {
+  unsigned long n = 0;
+  for (unsigned long i = 0; i < a.size(); i++)
+    n += a[i] != b[i];
+  return n;
+}
+
+// Tones between 50 and 550 ms long, at random frequencies and at amplitudes
+// between low and high
+static vector<LADSPA_Data> tones(unsigned long n, unsigned long sample_rate,
+                                 unsigned seed, float low, float high) {
+  mt19937 rng(seed);
+  uniform_real_distribution<float> u(0, 1);
+  vector<LADSPA_Data> x(n);
+  for (unsigned long i = 0; i < n;) {
+    unsigned long length = sample_rate * (0.05 + 0.5 * u(rng));
+    float amplitude = low + (high - low) * u(rng);
+    float frequency = 200 + 2000 * u(rng);
+    for (unsigned long k = 0; k < length && i < n; k++, i++)
+      x[i] = amplitude * sin(2 * M_PI * frequency * k / sample_rate);
+  }
+  return x;
+}
+
+// Loud bursts of noise between 200 and 800 ms long, 20 to 30 dB below full
+// scale, separated by 1.2 to 2 s of quiet noise 70 dB below
+static vector<LADSPA_Data> bursts(unsigned long n, unsigned long sample_rate,
+                                  unsigned seed) {
+  mt19937 rng(seed);
+  uniform_real_distribution<float> u(0, 1);
+  vector<LADSPA_Data> x(n);
+  bool loud = false;
+  for (unsigned long i = 0; i < n; loud = !loud) {
+    unsigned long length = sample_rate *
+      (loud ? 0.2 + 0.6 * u(rng) : 1.2 + 0.8 * u(rng));
+    float amplitude = pow(10.f, (loud ? -20 - 10 * u(rng) : -70) / 20);
+    for (unsigned long k = 0; k < length && i < n; k++, i++)
+      x[i] = amplitude * (2 * u(rng) - 1);
+  }
+  return x;
+}
+
+// The samples where the output switches between silence and sound, i.e. the
+// gate starts to open or finishes closing
+static vector<unsigned long> edges(const vector<LADSPA_Data> &output) {
+  vector<unsigned long> e;
+  for (unsigned long i = 1; i < output.size(); i++) {
+    if ((output[i] != 0) != (output[i - 1] != 0))
+      e.push_back(i);
+  }
+  return e;
+}
+
+// With a detector hop, every gate edge must stay within 2.5 hops of where it
+// is at the full rate, as long as there is one non-silent stretch per window
+// (see NoiseGate::detect_hops()).
+static void check_hop_edges() {
+  const unsigned long sample_rate = 48000;
+  const char *detectors[] = {"peak", "RMS", "peak follower"};
+  vector<LADSPA_Data> input = bursts(60 * sample_rate, sample_rate, 2);
+  for (int detector = 0; detector < 3; detector++) {
+    map<string, LADSPA_Data> controls = {
+      {"Threshold (dB)", -40},
+      {"Window size (ms)", 1000},
+      {"Non-silent audio per window (ms)", 50},
+      {"Attack/decay (ms)", 20},
+      {"Detector (0 = peak, 1 = RMS, 2 = peak follower)",
+       (LADSPA_Data) detector},
+    };
+    vector<unsigned long> full_rate = edges(run_plugin(5581, input, controls));
+    for (unsigned long hop : {4, 32, 128}) {
+      controls["Detector hop (samples)"] = hop;
+      vector<unsigned long> e = edges(run_plugin(5581, input, controls));
+      bool ok = e.size() == full_rate.size() && !e.empty();
+      double worst = 0;
+      for (unsigned long i = 0; ok && i < e.size(); i++)
+        worst = max(worst, fabs((double) e[i] - full_rate[i]) / hop);
+      ok = ok && worst <= 2.5;
+      check(ok, string("hop ") + to_string(hop) + ", " + detectors[detector] +
+            " detector: " + to_string(e.size()) + " edges (" +
+            to_string(full_rate.size()) + " at full rate), the furthest " +
+            to_string(worst) + " hops away");
+    }
+  }
+}
+
+// The transition window (5582) must give the same output as the bit window
+// (5581) with every detector, including the ones whose level can cross the
+// threshold every few samples.
+static void check_transition_window() {
+  const unsigned long sample_rate = 48000;
+  const char *detectors[] = {"peak", "RMS", "peak follower"};
+  // Levels around the -40 dB threshold, in peak and in RMS terms
+  vector<LADSPA_Data> signals[] = {
+    tones(20 * sample_rate, sample_rate, 1, 0.005, 0.0125),
+    tones(20 * sample_rate, sample_rate, 1, 0.01, 0.016),
+  };
+  for (int detector = 0; detector < 3; detector++) {
+    for (const auto &input : signals) {
+      map<string, LADSPA_Data> controls = {
+        {"Threshold (dB)", -40},
+        {"Window size (ms)", 3000},
+        {"Non-silent audio per window (ms)", 500},
+        {"Attack/decay (ms)", 30},
+        {"Detector (0 = peak, 1 = RMS, 2 = peak follower)",
+         (LADSPA_Data) detector},
+      };
+      unsigned long n = count_differences(run_plugin(5581, input, controls),
+                                          run_plugin(5582, input, controls));
+      check(n == 0, string("transition window matches bit window, ") +
+            detectors[detector] + " detector (" + to_string(n) +
+            " samples differ)");
+    }
+  }
+}
+
+// MaxWindow must give the maximum absolute value over the last window size
+// samples, leaving out the first window size - 1 after a reset (during which
+// it gives the current sample's), whatever the window size and however the
+// stream is cut into blocks, both from process() and from advance().
+static void check_max_window() {
+  mt19937 rng(3);
+  uniform_real_distribution<float> u(-1, 1);
+  MaxWindow<float> window(1000);
+  // The samples since the last window size change
+  vector<float> history;
+  unsigned long wrong = 0, total = 0;
+  float levels[block_size];
+  for (int round = 0; round < 2000; round++) {
+    if (round % 20 == 0) {
+      window.set_window_size(1 + rng() % 1000);
+      history.clear();
+    }
+    unsigned long n = 1 + rng() % block_size;
+    // Mostly quiet samples with a few loud ones, so that the maximum changes
+    float samples[block_size];
+    for (unsigned long i = 0; i < n; i++)
+      samples[i] = u(rng) * (rng() % 50 == 0 ? 1 : 0.01f);
+    bool levels_wanted = rng() % 2;
+    if (levels_wanted)
+      window.process(samples, levels, n);
+    else
+      window.advance(samples, n);
+    unsigned long size = window.size();
+    for (unsigned long i = 0; i < n; i++) {
+      history.push_back(samples[i]);
+      if (!levels_wanted && i < n - 1)
+        continue;
+      unsigned long k = history.size() - 1;
+      float expected = fabs(history[k]);
+      for (unsigned long j = max(k + 1, 2 * size - 1) - size; j < k; j++)
+        expected = max(expected, fabs(history[j]));
+      float level = levels_wanted ? levels[i] : window.level();
+      wrong += level != expected;
+      total++;
+    }
+  }
+  check(wrong == 0, "MaxWindow matches a naive maximum (" + to_string(wrong) +
+        " of " + to_string(total) + " levels differ)");
+}
+
+// The value of a SmoothingWindow curve at x (0 = closed, 1 = open)
+static double curve_value(SmoothingWindow::Curve curve, double x) {
+  switch (curve) {
+  case SmoothingWindow::EXPONENTIAL:
+    return x == 0 ? 0 : pow(1e-4, 1 - x);
+  case SmoothingWindow::LINEAR:
+    return x;
+  case SmoothingWindow::RAISED_COSINE:
+    return 0.5 - 0.5 * cos(M_PI * x);
+  case SmoothingWindow::EQUAL_POWER:
+    return sin(M_PI / 2 * x);
+  }
+  return 0;
+}
+
+// With the attack automated, i.e. the window size changing on every block,
+// SmoothingWindow must follow a sample-by-sample model of its ramps, within
+// the resolution of its tables.
+static void check_smoothing_window() {
+  const unsigned long max_size = 9600; // 200 ms at 48 kHz
+  const SmoothingWindow::Curve curves[] = {
+    SmoothingWindow::EXPONENTIAL, SmoothingWindow::LINEAR,
+    SmoothingWindow::RAISED_COSINE, SmoothingWindow::EQUAL_POWER,
+  };
+  const char *names[] = {"exponential", "linear", "raised cosine",
+                         "equal power"};
+  for (int c = 0; c < 4; c++) {
+    mt19937 rng(4);
+    SmoothingWindow window(max_size, curves[c]);
+    // The model's state, as in SmoothingWindow
+    unsigned long size = max_size, position = max_size, since_open = 0;
+    bool rising = true;
+    unsigned long wrong = 0;
+    double worst = 0;
+    bool open_run = true;
+    unsigned long run_left = 0;
+    for (int round = 0; round < 5000; round++) {
+      // Around 150 ms, in 64-sample blocks
+      unsigned long new_size = 6720 + rng() % 1000;
+      window.set_window_size(new_size);
+      position = (position * new_size + size / 2) / size;
+      since_open = min(since_open, new_size);
+      size = new_size;
+      const unsigned long n = 64;
+      bool open[n];
+      for (unsigned long i = 0; i < n; i++) {
+        if (run_left == 0) {
+          open_run = !open_run;
+          run_left = 1 + rng() % 20000;
+        }
+        open[i] = open_run;
+        run_left--;
+      }
+      LADSPA_Data gain[n];
+      SmoothingWindow::GainRun runs[n];
+      unsigned long n_runs = window.process(open, gain, runs, n);
+      for (unsigned long r = 0, i = 0; r < n_runs; r++) {
+        for (unsigned long k = 0; k < runs[r].length; k++, i++) {
+          if (!rising && open[i])
+            rising = true;
+          if (rising && open[i]) {
+            since_open = 0;
+          } else if (rising && since_open < size) {
+            since_open++;
+          } else {
+            rising = false;
+            since_open++;
+          }
+          if (rising && position < size)
+            position++;
+          else if (!rising && position > 0)
+            position--;
+          double expected = curve_value(curves[c], (double) position / size);
+          double g = runs[r].kind == SmoothingWindow::UNITY_GAIN ? 1 :
+            runs[r].kind == SmoothingWindow::ZERO_GAIN ? 0 : gain[i];
+          double error = fabs(g - expected);
+          worst = max(worst, error);
+          wrong += error > max(1e-3 * expected, 1e-4);
+        }
+      }
+    }
+    check(wrong == 0, string("SmoothingWindow with automated attack, ") +
+          names[c] + " curve: " + to_string(wrong) +
+          " gains off, the furthest by " + to_string(worst));
+  }
+}
+
+// PcmNoiseGate must gate integer samples like the plugin gates the same
+// samples as floats, to within the precision of its Q15 gain: 1 LSB of
+// 16-bit audio.
+template <typename Sample>
+static void check_pcm_gate(const char *name) {
+  const unsigned long sample_rate = 48000;
+  const float full_scale = SampleTraits<Sample>::full_scale();
+  vector<LADSPA_Data> input = bursts(30 * sample_rate, sample_rate, 5);
+  vector<Sample> pcm(input.size());
+  for (unsigned long i = 0; i < input.size(); i++) {
+    pcm[i] = (Sample) lrint((double) input[i] * full_scale);
+    input[i] = pcm[i] / full_scale;
+  }
+  map<string, LADSPA_Data> controls = {
+    {"Threshold (dB)", -40},
+    {"Window size (ms)", 500},
+    {"Non-silent audio per window (ms)", 50},
+    {"Attack/decay (ms)", 30},
+  };
+  vector<LADSPA_Data> expected = run_plugin(5581, input, controls);
+  PcmNoiseGate<Sample> gate(sample_rate);
+  gate.set_threshold(-40);
+  gate.set_min_nonsilent(50);
+  gate.set_window(500, 30);
+  vector<Sample> output(pcm.size());
+  for (unsigned long start = 0; start < pcm.size(); start += 1000) {
+    unsigned long n = min(1000ul, pcm.size() - start);
+    gate.run(pcm.data() + start, output.data() + start, n);
+  }
+  unsigned long wrong = 0;
+  double worst = 0;
+  for (unsigned long i = 0; i < output.size(); i++) {
+    double error = fabs(output[i] / full_scale - expected[i]) * 32768;
+    worst = max(worst, error);
+    wrong += error > 1;
+  }
+  check(wrong == 0, string("PcmNoiseGate<") + name + "> matches the plugin: " +
+        to_string(wrong) + " samples more than 1 LSB off, the furthest " +
+        to_string(worst) + " LSB");
+}
+
+int main() {
+  check_max_window();
+  check_smoothing_window();
+  check_pcm_gate<int16_t>("int16_t");
+  check_pcm_gate<int32_t>("int32_t");
+  check_transition_window();
+  check_hop_edges();
+  return failures != 0;
+}